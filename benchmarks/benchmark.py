@@ -7,6 +7,9 @@ This script tests and compares the performance of different approaches:
 2. Kernel module implementation
 3. Hybrid approach
 
+The pointer transform (fixed-point DPI scale, acceleration curve and
+angle snap) is timed separately by transform_bench.c.
+
 Metrics measured:
 - Latency (time from button press to key injection)
 - CPU usage
@@ -69,6 +72,10 @@ class PerformanceBenchmark:
             if result:
                 self.results.append(result)
         
+        # Test the kernel module's pointer transform cost
+        print("\nTesting pointer transform...")
+        self.benchmark_pointer_transform()
+        
         # Generate report
         self.generate_report()
     
@@ -226,6 +233,20 @@ class PerformanceBenchmark:
             reliability_percent=100.0
         )
     
+    def benchmark_pointer_transform(self):
+        """Build and run transform_bench.c against the 1 kHz report budget"""
+        source = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                              "transform_bench.c")
+        binary = "/tmp/m720_transform_bench"
+        
+        try:
+            subprocess.run(["cc", "-O2", "-o", binary, source], check=True)
+            output = subprocess.run([binary], check=True, capture_output=True,
+                                    text=True).stdout
+            print("  " + output.rstrip().replace("\n", "\n  "))
+        except (OSError, subprocess.CalledProcessError) as e:
+            print(f"  Error benchmarking pointer transform: {e}")
+    
     def generate_report(self):
         """Generate and display benchmark report"""
         if not self.results:
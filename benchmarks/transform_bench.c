@@ -0,0 +1,146 @@
+/*
+ * Pointer transform benchmark
+ *
+ * Builds the kernel module's fixed-point pointer transform
+ * (kernel-module/c-implementation/m720_transform.h) in userspace and
+ * runs it over a synthetic 1 kHz motion trace, reporting the cost per
+ * report against the 1 ms budget a 1 kHz mouse leaves.
+ *
+ *   cc -O2 -o transform_bench transform_bench.c && ./transform_bench
+ *
+ * Also checks that a unity transform reproduces the input exactly, i.e.
+ * that no subpixel motion is lost across reports.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Kernel types and helpers used by m720_transform.h */
+typedef int32_t s32;
+typedef uint32_t u32;
+typedef int64_t s64;
+typedef uint64_t u64;
+#define U32_MAX UINT32_MAX
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) min((t)(a), (t)(b))
+#define div_u64(a, b) ((u64)(a) / (b))
+
+#include "../kernel-module/c-implementation/m720_transform.h"
+
+#define REPORTS         1000000
+#define BATCH           1000
+#define INTERVAL_US     1000
+#define BUDGET_NS       (INTERVAL_US * 1000)
+
+struct trace {
+    s32 dx[REPORTS];
+    s32 dy[REPORTS];
+};
+
+struct config {
+    const char *name;
+    u32 scale;
+    u32 curve[M720_ACCEL_POINTS];
+    u32 points;
+    u32 snap;
+};
+
+static const struct config configs[] = {
+    { "unity",            100, { 0 }, 0, 0 },
+    { "scale 80%",        80,  { 0 }, 0, 0 },
+    { "scale+curve",      80,  { 100, 100, 110, 125, 140, 160, 180, 200 }, 8, 0 },
+    { "scale+curve+snap", 80,  { 100, 100, 110, 125, 140, 160, 180, 200 }, 8, 8 },
+};
+
+/*
+ * Strokes of varying speed and direction with sensor-like jitter, from a
+ * fixed-seed LCG so every run sees the same trace
+ */
+static void make_trace(struct trace *t)
+{
+    u32 seed = 720;
+    s32 speed = 0, dirx = 1, diry = 0;
+    int i;
+
+    for (i = 0; i < REPORTS; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        if (i % 500 == 0) {
+            speed = (seed >> 8) % 40;
+            dirx = (s32)((seed >> 16) % 9) - 4;
+            diry = (s32)((seed >> 20) % 9) - 4;
+        }
+        t->dx[i] = speed * dirx / 4 + (s32)((seed >> 24) % 3) - 1;
+        t->dy[i] = speed * diry / 4 + (s32)((seed >> 26) % 3) - 1;
+    }
+}
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void run(const struct config *c, const struct trace *t)
+{
+    struct m720_xform xf;
+    struct m720_xform_state st = { 0 };
+    s64 in_x = 0, out_x = 0, in_y = 0, out_y = 0;
+    u64 start, batch_start, worst = 0, total;
+    s32 dx, dy;
+    int i;
+
+    m720_xform_setup(&xf, c->scale, c->curve, c->points, c->snap);
+
+    start = batch_start = now_ns();
+    for (i = 0; i < REPORTS; i++) {
+        dx = t->dx[i];
+        dy = t->dy[i];
+        in_x += dx;
+        in_y += dy;
+        m720_xform_apply(&xf, &st, &dx, &dy, INTERVAL_US);
+        out_x += dx;
+        out_y += dy;
+
+        if ((i + 1) % BATCH == 0) {
+            u64 end = now_ns();
+
+            if (end - batch_start > worst)
+                worst = end - batch_start;
+            batch_start = end;
+        }
+    }
+    total = now_ns() - start;
+
+    printf("%-18s %8.1f ns %10.1f ns %9.4f%%   out %lld,%lld",
+           c->name, (double)total / REPORTS, (double)worst / BATCH,
+           100.0 * worst / BATCH / BUDGET_NS,
+           (long long)out_x, (long long)out_y);
+    if (c->scale == 100 && !c->points && !c->snap)
+        printf("  %s", in_x == out_x && in_y == out_y ? "exact" : "DRIFT");
+    printf("\n");
+}
+
+int main(void)
+{
+    struct trace *t = malloc(sizeof(*t));
+    size_t i;
+
+    if (!t)
+        return 1;
+    make_trace(t);
+
+    printf("%d reports at %d us, 1 ms budget per report\n\n",
+           REPORTS, INTERVAL_US);
+    printf("%-18s %11s %13s %10s\n",
+           "transform", "mean/report", "worst batch", "of budget");
+    for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+        run(&configs[i], t);
+
+    free(t);
+    return 0;
+}
@@ -0,0 +1,265 @@
+#!/usr/bin/env python3
+"""
+Generate m720_profile.h from a profile file for a fixed-profile build.
+
+    make PROFILE=profiles/default.conf
+
+A profile holds one "button = macro" line per mapped button, in the
+syntax of the keymap module parameter, and optionally the event-path
+settings that are module parameters in the generic build:
+
+    side = leftmeta+pagedown
+    forward = leftalt+tab
+    debounce_ms = 0,0,0,30,30,0,0,0
+    rate_limit = 4
+
+Macros are compiled here exactly as m720_compile_macro() does at
+runtime, so the module only carries constant tables.
+"""
+
+import re
+import sys
+
+# Mirrors m720_remapper.h
+MACRO_MAX_STEPS = 32
+MACRO_MAX_DELAY_MS = 1000
+CHORD_MAX_KEYS = 6
+CHORD_HOLD_MS = 10
+KEY_CNT = 0x300
+
+# Mirrors m720_transform.h
+XFORM_SHIFT = 16
+ACCEL_POINTS = 16
+SNAP_MAX_DEG = 30
+XFORM_MAX_PCT = 1000
+TAN_Q16 = [
+    0, 1144, 2289, 3435, 4583, 5734, 6888, 8047,
+    9210, 10380, 11556, 12739, 13930, 15130, 16340, 17560,
+    18792, 20036, 21294, 22566, 23853, 25157, 26478, 27818,
+    29179, 30560, 31964, 33392, 34846, 36327, 37837,
+]
+
+BUTTONS = ["left", "right", "middle", "side", "extra", "forward", "back", "task"]
+WHEELS = ["wheel_up", "wheel_down", "wheel_left", "wheel_right"]
+GESTURES = ["gesture_left", "gesture_right", "gesture_up", "gesture_down"]
+
+# Mirrors m720_key_names[]
+KEY_ALIASES = {
+    "ctrl": "KEY_LEFTCTRL", "shift": "KEY_LEFTSHIFT", "alt": "KEY_LEFTALT",
+    "super": "KEY_LEFTMETA", "meta": "KEY_LEFTMETA", "print": "KEY_SYSRQ",
+    "stop": "KEY_STOPCD", "browserback": "KEY_BACK",
+    "browserforward": "KEY_FORWARD",
+}
+KEY_NAMES = [
+    "leftctrl", "rightctrl", "leftshift", "rightshift", "leftalt",
+    "rightalt", "leftmeta", "rightmeta", "up", "down", "left", "right",
+    "pageup", "pagedown", "home", "end", "insert", "delete", "enter", "esc",
+    "tab", "space", "backspace", "minus", "equal", "mute", "volumeup",
+    "volumedown", "playpause", "nextsong", "previoussong",
+] + [chr(c) for c in range(ord("a"), ord("z") + 1)] \
+  + [str(n) for n in range(10)] \
+  + ["f%d" % n for n in range(1, 13)]
+
+SETTINGS = {
+    "remap_side_buttons": ("remap_side", "bool", "true"),
+    "remap_extra_buttons": ("remap_extra", "bool", "true"),
+    "preserve_timestamps": ("preserve_timestamps", "bool", "true"),
+    "rate_limit": ("rate_limit", "uint", "0"),
+    "rate_burst": ("rate_burst", "uint", "3"),
+    "debounce_ms": ("debounce_ms", "array", "{ 0 }"),
+    "kinetic_scroll": ("kinetic_scroll", "bool", "false"),
+    "scroll_friction": ("scroll_friction", "permille", "60"),
+    "pointer_transform": ("pointer_transform", "bool", "false"),
+    "gesture_threshold": ("gesture_threshold", "count", "50"),
+}
+
+# Folded into .xform by xform_setup()
+XFORM_SETTINGS = {"pointer_scale": 100, "accel_curve": [], "angle_snap": 0}
+
+
+class ProfileError(Exception):
+    pass
+
+
+def parse_key(token):
+    if token.isdigit():
+        code = int(token)
+        if not 0 < code < KEY_CNT:
+            raise ProfileError("key code %s out of range" % token)
+        return str(code)
+    name = token.lower()
+    if name in KEY_ALIASES:
+        return KEY_ALIASES[name]
+    if name in KEY_NAMES:
+        return "KEY_" + name.upper()
+    raise ProfileError("unknown key '%s'" % token)
+
+
+def compile_macro(spec):
+    steps = []
+    for token in re.split(r"[, ]", spec):
+        if not token:
+            continue
+        if token.lower().startswith(("layer:", "toggle:")):
+            raise ProfileError("layer keys need the generic build")
+        if len(token) > 2 and token.lower().endswith("ms"):
+            delay = token[:-2]
+            if not delay.isdigit() or int(delay) > MACRO_MAX_DELAY_MS:
+                raise ProfileError("bad delay '%s'" % token)
+            steps.append(("M720_STEP_DELAY", delay))
+            continue
+        chord = [parse_key(key) for key in token.split("+")]
+        if len(chord) > CHORD_MAX_KEYS:
+            raise ProfileError("chord '%s' has too many keys" % token)
+        steps += [("M720_STEP_PRESS", key) for key in chord]
+        steps.append(("M720_STEP_SYNC", "0"))
+        steps.append(("M720_STEP_DELAY", str(CHORD_HOLD_MS)))
+        steps += [("M720_STEP_RELEASE", key) for key in reversed(chord)]
+        steps.append(("M720_STEP_SYNC", "0"))
+    if len(steps) > MACRO_MAX_STEPS:
+        raise ProfileError("macro '%s' needs more than %d steps"
+                           % (spec, MACRO_MAX_STEPS))
+    return steps
+
+
+def parse_setting(kind, value):
+    if kind == "bool":
+        if value.lower() in ("1", "y", "yes", "true", "on"):
+            return "true"
+        if value.lower() in ("0", "n", "no", "false", "off"):
+            return "false"
+    elif kind == "uint" and value.isdigit():
+        return value
+    elif kind == "count" and value.isdigit():
+        # At least 1, as m720_config_publish() clamps it
+        return str(max(int(value), 1))
+    elif kind == "permille" and value.isdigit() and int(value) <= 1000:
+        return value
+    elif kind == "array":
+        values = [v.strip() for v in value.split(",")]
+        if len(values) <= len(BUTTONS) and all(v.isdigit() for v in values):
+            return "{ %s }" % ", ".join(values)
+    raise ProfileError("bad value '%s'" % value)
+
+
+def xform_setup(scale_pct, curve_pct, snap_deg):
+    """m720_xform_setup(), producing the initializer"""
+    points = max(min(len(curve_pct), ACCEL_POINTS), 1)
+    if curve_pct:
+        gain = [(min(pct, XFORM_MAX_PCT) << XFORM_SHIFT) // 100
+                for pct in curve_pct[:points]]
+    else:
+        gain = [1 << XFORM_SHIFT]
+    gain += [gain[-1]] * (ACCEL_POINTS - points)
+    return ("{ .scale = %d, .gain = { %s }, .points = %d, .snap_tan = %d }"
+            % ((min(scale_pct, XFORM_MAX_PCT) << XFORM_SHIFT) // 100,
+               ", ".join(str(g) for g in gain), points,
+               TAN_Q16[min(snap_deg, SNAP_MAX_DEG)]))
+
+
+def parse_xform(name, value):
+    if name == "accel_curve":
+        values = [v.strip() for v in value.split(",")]
+        if len(values) <= ACCEL_POINTS and all(v.isdigit() for v in values):
+            return [int(v) for v in values]
+    elif value.isdigit():
+        return int(value)
+    raise ProfileError("bad value '%s'" % value)
+
+
+def macro_table_entry(index, steps, keys):
+    """One designated initializer of a struct m720_macro table"""
+    out = ["    [%s] = {" % index,
+           "        .len = %d," % len(steps),
+           "        .steps = {"]
+    for op, arg in steps:
+        out.append("            { %s, %s }," % (op, arg))
+        if op == "M720_STEP_PRESS" and arg not in keys:
+            keys.append(arg)
+    out += ["        },", "    },"]
+    return out
+
+
+def generate(path):
+    actions = {}
+    wheels = {}
+    gestures = {}
+    gesture_button = "0"
+    settings = {}
+    xform = dict(XFORM_SETTINGS)
+
+    with open(path) as conf:
+        for lineno, line in enumerate(conf, 1):
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+            try:
+                if "=" not in line:
+                    raise ProfileError("expected 'name = value'")
+                name, value = (part.strip() for part in line.split("=", 1))
+                if name.lower() in BUTTONS:
+                    actions[name.lower()] = compile_macro(value)
+                elif name.lower() in WHEELS:
+                    wheels[name.lower()] = compile_macro(value)
+                elif name.lower() in GESTURES:
+                    gestures[name.lower()] = compile_macro(value)
+                elif name.lower() == "gesture":
+                    if value.lower() not in BUTTONS:
+                        raise ProfileError("unknown button '%s'" % value)
+                    gesture_button = "BTN_" + value.upper()
+                elif name in SETTINGS:
+                    field, kind, _ = SETTINGS[name]
+                    settings[field] = parse_setting(kind, value)
+                elif name in XFORM_SETTINGS:
+                    xform[name] = parse_xform(name, value)
+                else:
+                    raise ProfileError("unknown button or setting '%s'" % name)
+            except ProfileError as err:
+                raise ProfileError("%s:%d: %s" % (path, lineno, err))
+
+    keys = []
+    out = ["/* Generated by gen_profile.py from %s - do not edit */" % path,
+           "#ifndef M720_PROFILE_H",
+           "#define M720_PROFILE_H",
+           "",
+           '#define M720_FIXED_PROFILE_NAME "%s"' % path,
+           "",
+           "static const struct m720_config m720_fixed_config = {"]
+    for field, _, default in SETTINGS.values():
+        out.append("    .%s = %s," % (field, settings.get(field, default)))
+    out.append("    .xform = %s," % xform_setup(xform["pointer_scale"],
+                                              xform["accel_curve"],
+                                              xform["angle_snap"]))
+    out += ["};", "",
+            "static const struct m720_macro m720_fixed_actions[M720_NUM_BUTTONS] = {"]
+    for button, steps in actions.items():
+        out += macro_table_entry("BTN_%s - BTN_MOUSE" % button.upper(),
+                                 steps, keys)
+    out += ["};", "",
+            "static const struct m720_macro m720_fixed_wheel[M720_WHEEL_DIRS] = {"]
+    for wheel, steps in wheels.items():
+        out += macro_table_entry("M720_" + wheel.upper(), steps, keys)
+    out += ["};", "",
+            "#define M720_FIXED_GESTURE_BUTTON %s" % gesture_button, "",
+            "static const struct m720_macro m720_fixed_gestures[M720_GESTURE_DIRS] = {"]
+    for gesture, steps in gestures.items():
+        out += macro_table_entry("M720_" + gesture.upper(), steps, keys)
+    out += ["};", "",
+            "/* Every key the profile presses, for the virtual keyboard */",
+            "static const u16 m720_fixed_keys[] = {"]
+    out += ["    %s," % key for key in keys]
+    out += ["};", "", "#endif /* M720_PROFILE_H */"]
+    return "\n".join(out) + "\n"
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: %s <profile.conf>" % sys.argv[0])
+    try:
+        sys.stdout.write(generate(sys.argv[1]))
+    except (OSError, ProfileError) as err:
+        sys.exit("gen_profile.py: %s" % err)
+
+
+if __name__ == "__main__":
+    main()
@@ -11,22 +11,195 @@
 
 #include "m720_remapper.h"
 
+#ifndef M720_FIXED_PROFILE
+/*
+ * Parameters read on the event path are not used directly: each write
+ * republishes them together as one struct m720_config, see
+ * m720_config_publish().
+ */
+#define M720_CONFIG_OPS(type, ops_flags)                                    \
+static int m720_config_set_##type(const char *val,                          \
+                                  const struct kernel_param *kp)            \
+{                                                                           \
+    return param_set_##type(val, kp) ?: m720_config_publish();              \
+}                                                                           \
+static const struct kernel_param_ops m720_config_##type##_ops = {           \
+    .flags = ops_flags,                                                     \
+    .set = m720_config_set_##type,                                          \
+    .get = param_get_##type,                                                \
+}
+
+M720_CONFIG_OPS(int, 0);
+M720_CONFIG_OPS(uint, 0);
+M720_CONFIG_OPS(bool, KERNEL_PARAM_OPS_FL_NOARG);
+
+static int m720_config_set_array(const char *val,
+                                 const struct kernel_param *kp)
+{
+    return param_array_ops.set(val, kp) ?: m720_config_publish();
+}
+
+static int m720_config_get_array(char *buffer, const struct kernel_param *kp)
+{
+    return param_array_ops.get(buffer, kp);
+}
+
+static const struct kernel_param_ops m720_config_array_ops = {
+    .set = m720_config_set_array,
+    .get = m720_config_get_array,
+};
+
 /* Module parameters */
+#ifdef DEBUG
+static int debug_mode = 1;
+#else
 static int debug_mode = 0;
+#endif
 module_param(debug_mode, int, 0644);
 MODULE_PARM_DESC(debug_mode, "Enable debug output (0=disabled, 1=enabled)");
 
 static int remap_side_buttons = 1;
-module_param(remap_side_buttons, int, 0644);
+module_param_cb(remap_side_buttons, &m720_config_int_ops, &remap_side_buttons, 0644);
 MODULE_PARM_DESC(remap_side_buttons, "Remap side buttons (0=disabled, 1=enabled)");
 
 static int remap_extra_buttons = 1;
-module_param(remap_extra_buttons, int, 0644);
+module_param_cb(remap_extra_buttons, &m720_config_int_ops, &remap_extra_buttons, 0644);
 MODULE_PARM_DESC(remap_extra_buttons, "Remap extra buttons (0=disabled, 1=enabled)");
 
+static unsigned int debounce_ms[M720_NUM_BUTTONS];
+static struct kparam_array m720_debounce_array = {
+    .max = M720_NUM_BUTTONS,
+    .elemsize = sizeof(debounce_ms[0]),
+    .ops = &param_ops_uint,
+    .elem = debounce_ms,
+};
+module_param_cb(debounce_ms, &m720_config_array_ops, &m720_debounce_array, 0644);
+MODULE_PARM_DESC(debounce_ms, "Per-button debounce window in ms, ordered left,right,middle,side,extra,forward,back,task (0=off)");
+
+static unsigned int rate_limit = 0;
+module_param_cb(rate_limit, &m720_config_uint_ops, &rate_limit, 0644);
+MODULE_PARM_DESC(rate_limit, "Sustained actions per second per button and device (0=unlimited)");
+
+static unsigned int rate_burst = 3;
+module_param_cb(rate_burst, &m720_config_uint_ops, &rate_burst, 0644);
+MODULE_PARM_DESC(rate_burst, "Actions allowed back to back before rate_limit applies");
+
+static bool preserve_timestamps = true;
+module_param_cb(preserve_timestamps, &m720_config_bool_ops, &preserve_timestamps, 0644);
+MODULE_PARM_DESC(preserve_timestamps, "Stamp injected keys with the source button's event time");
+
+static bool kinetic_scroll = false;
+module_param_cb(kinetic_scroll, &m720_config_bool_ops, &kinetic_scroll, 0644);
+MODULE_PARM_DESC(kinetic_scroll, "Smooth hi-res wheel motion and let it coast after the wheel stops");
+
+static unsigned int scroll_friction = 60;
+module_param_cb(scroll_friction, &m720_config_uint_ops, &scroll_friction, 0644);
+MODULE_PARM_DESC(scroll_friction, "Coasting velocity lost per 8 ms tick, per mille (1000=no coasting)");
+
+static bool pointer_transform = false;
+module_param_cb(pointer_transform, &m720_config_bool_ops, &pointer_transform, 0644);
+MODULE_PARM_DESC(pointer_transform, "Apply pointer_scale, accel_curve and angle_snap to pointer motion");
+
+static unsigned int pointer_scale = 100;
+module_param_cb(pointer_scale, &m720_config_uint_ops, &pointer_scale, 0644);
+MODULE_PARM_DESC(pointer_scale, "DPI scale for pointer motion, percent (max 1000)");
+
+static unsigned int accel_curve[M720_ACCEL_POINTS];
+static unsigned int accel_points;
+static struct kparam_array m720_accel_array = {
+    .max = M720_ACCEL_POINTS,
+    .elemsize = sizeof(accel_curve[0]),
+    .num = &accel_points,
+    .ops = &param_ops_uint,
+    .elem = accel_curve,
+};
+module_param_cb(accel_curve, &m720_config_array_ops, &m720_accel_array, 0644);
+MODULE_PARM_DESC(accel_curve, "Pointer gain in percent at 0, 2, 4, ... counts/ms, interpolated (empty=flat)");
+
+static unsigned int angle_snap = 0;
+module_param_cb(angle_snap, &m720_config_uint_ops, &angle_snap, 0644);
+MODULE_PARM_DESC(angle_snap, "Snap motion within this many degrees of an axis onto it (0=off, max 30)");
+
+static unsigned int gesture_threshold = 50;
+module_param_cb(gesture_threshold, &m720_config_uint_ops, &gesture_threshold, 0644);
+MODULE_PARM_DESC(gesture_threshold, "Pointer travel in counts that turns a gesture button click into a swipe");
+#else
+/*
+ * Fixed-profile build: the event-path settings are the constants in
+ * m720_profile.h and debug output is compiled out.
+ */
+#define debug_mode 0
+#endif
+
+static unsigned int park_slots = 4;
+module_param(park_slots, uint, 0644);
+MODULE_PARM_DESC(park_slots, "Disconnected mice whose state is kept for reconnect, least recent evicted first (0=disabled)");
+
+static unsigned int handover_ms = 0;
+module_param(handover_ms, uint, 0644);
+MODULE_PARM_DESC(handover_ms, "Drop parked state after this many ms (0=keep until evicted)");
+
+static unsigned int output_grace_ms = 10000;
+module_param(output_grace_ms, uint, 0644);
+MODULE_PARM_DESC(output_grace_ms, "Keep a virtual keyboard this many ms after its last mouse disconnects");
+
+static bool seat_routing = false;
+module_param(seat_routing, bool, 0444);
+MODULE_PARM_DESC(seat_routing, "Give each seat (source port or adapter) its own virtual keyboard");
+
+static bool msc_timestamp = false;
+module_param(msc_timestamp, bool, 0444);
+MODULE_PARM_DESC(msc_timestamp, "Add MSC_TIMESTAMP (us, hardware clock when the mouse sends one) to injected frames");
+
+static bool companion_inject = false;
+module_param(companion_inject, bool, 0444);
+MODULE_PARM_DESC(companion_inject, "Inject keys into a real keyboard on the seat instead of a virtual one when it has every key");
+
+static unsigned int track_modifiers = 0;
+module_param(track_modifiers, uint, 0444);
+MODULE_PARM_DESC(track_modifiers, "Track keyboard modifiers for chords (0=off, 1=Logitech keyboards, 2=any keyboard)");
+
 /* Global variables */
 static struct input_handler m720_handler;
-static struct input_dev *global_virtual_kbd = NULL;
+static struct input_handler m720_companion_handler;
+static struct input_handler m720_tracker_handler;
+static LIST_HEAD(m720_outputs);
+static LIST_HEAD(m720_companions);
+static DEFINE_MUTEX(m720_output_lock);
+static void m720_output_expire(struct work_struct *work);
+static DECLARE_DELAYED_WORK(m720_output_idle_work, m720_output_expire);
+
+/*
+ * Device states: connected ones on m720_devices, disconnected ones parked
+ * for reconnect on m720_parked (least recently disconnected first), and
+ * the identity aliases tying transports of one mouse together.
+ */
+static LIST_HEAD(m720_devices);
+static LIST_HEAD(m720_parked);
+static unsigned int m720_parked_count;
+static struct m720_alias m720_aliases[M720_MAX_ALIASES];
+static unsigned int m720_alias_count;
+static DEFINE_MUTEX(m720_state_lock);
+static void m720_park_expire(struct work_struct *work);
+static DECLARE_DELAYED_WORK(m720_park_work, m720_park_expire);
+
+/* Event-path config, keymap slots and the union of their keys, under m720_config_lock */
+#ifdef M720_FIXED_PROFILE
+#define m720_config_snapshot() (&m720_fixed_config)
+#else
+static struct m720_config __rcu *m720_config;
+static struct m720_keymap __rcu *m720_profiles[M720_MAX_PROFILES];
+static struct m720_program __rcu *m720_program;
+static u32 m720_program_gen;
+#define m720_config_snapshot() rcu_dereference(m720_config)
+#endif
+static struct m720_rules __rcu *m720_rules;
+static DECLARE_BITMAP(m720_keybit, KEY_CNT);
+static DEFINE_MUTEX(m720_config_lock);
+static struct kmem_cache *m720_device_cache;
+#ifndef M720_FIXED_PROFILE
+static struct dentry *m720_debugfs_root;
+#endif
 static int device_count = 0;
 
 /* Device ID table for M720 variants */
@@ -41,6 +214,36 @@ static const struct input_device_id m720_ids[] = {
 
 MODULE_DEVICE_TABLE(input, m720_ids);
 
+/* Keyboards that can carry injected keys for companion_inject */
+static const struct input_device_id m720_companion_ids[] = {
+    {
+        .flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_KEYBIT,
+        .evbit = { BIT_MASK(EV_KEY) },
+        .keybit = { [BIT_WORD(KEY_A)] = BIT_MASK(KEY_A) },
+    },
+    { }, /* Terminating entry */
+};
+
+/* Keyboards whose modifiers can be tracked for track_modifiers */
+static const struct input_device_id m720_tracker_ids[] = {
+    {
+        .flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_KEYBIT,
+        .evbit = { BIT_MASK(EV_KEY) },
+        .keybit = { [BIT_WORD(KEY_LEFTCTRL)] = BIT_MASK(KEY_LEFTCTRL) },
+    },
+    { }, /* Terminating entry */
+};
+
+/*
+ * Modifier keys held on the tracked keyboards: a byte-wide hold count
+ * per m720_mod_keys[] entry, so updates are single atomic adds and two
+ * keyboards holding Ctrl still read as held after one lets go. Set per
+ * CPU while we inject into a companion keyboard, so our own keys are
+ * not counted.
+ */
+static atomic64_t m720_mod_count = ATOMIC64_INIT(0);
+static DEFINE_PER_CPU(bool, m720_injecting);
+
 /* Debug macro */
 #define m720_debug(fmt, args...) \
     do { \
@@ -49,61 +252,28 @@ MODULE_DEVICE_TABLE(input, m720_ids);
     } while (0)
 
 /*
- * Check if the input device is a Logitech M720
+ * Check if the input device is one of our own virtual keyboards
+ */
+static bool m720_is_own_device(struct input_dev *dev)
+{
+    return dev->id.bustype == BUS_VIRTUAL && dev->phys &&
+           !strncmp(dev->phys, "m720/", 5);
+}
+
+/*
+ * Check if the input device is a Logitech M720, as the match rules
+ * decide
  */
 static bool is_m720_device(struct input_dev *dev)
 {
-    struct usb_device *usb_dev;
-    struct hid_device *hid_dev;
-    
-    if (!dev || !dev->name)
+    if (!dev)
         return false;
     
-    /* Check device name patterns */
-    if (strstr(dev->name, "M720") || 
-        strstr(dev->name, "Logitech MX Master") ||
-        strstr(dev->name, "Logitech Wireless Mouse")) {
-        
-        m720_debug("Found potential M720 device by name: %s\n", dev->name);
-        
-        /* Try to get USB device info */
-        if (dev->dev.parent && dev->dev.parent->parent) {
-            usb_dev = to_usb_device(dev->dev.parent->parent);
-            if (usb_dev && 
-                usb_dev->descriptor.idVendor == LOGITECH_VENDOR_ID) {
-                
-                m720_debug("USB device - Vendor: 0x%04x, Product: 0x%04x\n",
-                          usb_dev->descriptor.idVendor,
-                          usb_dev->descriptor.idProduct);
-                
-                /* Check for known M720 product IDs */
-                if (usb_dev->descriptor.idProduct == M720_PRODUCT_ID_1 ||
-                    usb_dev->descriptor.idProduct == M720_PRODUCT_ID_2 ||
-                    usb_dev->descriptor.idProduct == M720_PRODUCT_ID_3) {
-                    return true;
-                }
-            }
-        }
-        
-        /* Try HID device info */
-        if (dev->dev.parent) {
-            hid_dev = to_hid_device(dev->dev.parent);
-            if (hid_dev && hid_dev->vendor == LOGITECH_VENDOR_ID) {
-                m720_debug("HID device - Vendor: 0x%04x, Product: 0x%04x\n",
-                          hid_dev->vendor, hid_dev->product);
-                return true;
-            }
-        }
-        
-        /* Fallback: if name matches and has required buttons, assume it's M720 */
-        if (test_bit(BTN_SIDE, dev->keybit) && 
-            test_bit(BTN_EXTRA, dev->keybit)) {
-            m720_debug("Device has required buttons, assuming M720\n");
-            return true;
-        }
-    }
+    /* Never bind to our own virtual keyboards, whatever keys they carry */
+    if (m720_is_own_device(dev))
+        return false;
     
-    return false;
+    return m720_rules_match(dev);
 }
 
 /*
@@ -141,7 +311,8 @@ static void print_device_info(struct input_dev *dev)
 /*
  * Create virtual keyboard device for sending key combinations
  */
-static struct input_dev *create_virtual_keyboard(void)
+static struct input_dev *create_virtual_keyboard(const struct m720_output *output,
+                                                 const unsigned long *keybit)
 {
     struct input_dev *virt_kbd;
     int error;
@@ -153,7 +324,8 @@ static struct input_dev *create_virtual_keyboard(void)
     }
     
     virt_kbd->name = "M720 Virtual Keyboard";
-    virt_kbd->phys = "m720/input/kbd";
+    virt_kbd->phys = output->phys;
+    virt_kbd->uniq = output->seat;
     virt_kbd->id.bustype = BUS_VIRTUAL;
     virt_kbd->id.vendor = 0x0001;
     virt_kbd->id.product = 0x0001;
@@ -162,13 +334,13 @@ static struct input_dev *create_virtual_keyboard(void)
     /* Set up key capabilities */
     __set_bit(EV_KEY, virt_kbd->evbit);
     __set_bit(EV_SYN, virt_kbd->evbit);
+    if (msc_timestamp) {
+        __set_bit(EV_MSC, virt_kbd->evbit);
+        __set_bit(MSC_TIMESTAMP, virt_kbd->mscbit);
+    }
     
-    /* Add keys we need for workspace switching */
-    __set_bit(KEY_LEFTMETA, virt_kbd->keybit);
-    __set_bit(KEY_PAGEUP, virt_kbd->keybit);
-    __set_bit(KEY_PAGEDOWN, virt_kbd->keybit);
-    __set_bit(KEY_LEFTALT, virt_kbd->keybit);
-    __set_bit(KEY_TAB, virt_kbd->keybit);
+    /* Advertise every key the loaded keymaps can send */
+    bitmap_copy(virt_kbd->keybit, keybit, KEY_CNT);
     
     error = input_register_device(virt_kbd);
     if (error) {
@@ -177,7 +349,8 @@ static struct input_dev *create_virtual_keyboard(void)
         return NULL;
     }
     
-    m720_debug("Virtual keyboard created successfully\n");
+    m720_debug("Virtual keyboard for seat %s created successfully\n",
+               output->seat);
     return virt_kbd;
 }
 
@@ -193,268 +366,4094 @@ static void destroy_virtual_keyboard(struct input_dev *virt_kbd)
 }
 
 /*
- * Send key combination via virtual keyboard
+ * Derive the seat tag for a source device: its phys path up to the
+ * last '/', i.e. the USB port or Bluetooth adapter it hangs off.
  */
-static void send_key_combination(struct input_dev *virt_kbd, 
-                                unsigned int key1, unsigned int key2)
+static void m720_seat_tag(struct input_dev *dev, char *seat, size_t len)
 {
-    if (!virt_kbd) {
-        printk(KERN_ERR MODULE_NAME ": Virtual keyboard not available\n");
+    char *slash;
+
+    if (!seat_routing || !dev->phys || !*dev->phys) {
+        strscpy(seat, M720_DEFAULT_SEAT, len);
         return;
     }
-    
-    m720_debug("Sending key combination: %d + %d\n", key1, key2);
-    
-    /* Press keys */
-    input_report_key(virt_kbd, key1, 1);
-    input_report_key(virt_kbd, key2, 1);
-    input_sync(virt_kbd);
-    
-    /* Small delay */
-    msleep(10);
-    
-    /* Release keys */
-    input_report_key(virt_kbd, key2, 0);
-    input_report_key(virt_kbd, key1, 0);
-    input_sync(virt_kbd);
+
+    strscpy(seat, dev->phys, len);
+    slash = strrchr(seat, '/');
+    if (slash && slash != seat)
+        *slash = '\0';
 }
 
 /*
- * Handle input events from M720 mouse
+ * Pick a companion keyboard on a seat that advertises every key in
+ * keybit. Must be called with m720_output_lock held.
  */
-static void m720_event(struct input_handle *handle, unsigned int type,
-                      unsigned int code, int value)
+static struct m720_companion *m720_companion_pick(const char *seat,
+                                                  const unsigned long *keybit)
 {
-    struct m720_device *m720_dev = handle->private;
-    
-    /* Only process key events */
-    if (type != EV_KEY)
+    struct m720_companion *companion;
+
+    list_for_each_entry(companion, &m720_companions, node) {
+        if (!strcmp(companion->seat, seat) &&
+            bitmap_subset(keybit, companion->handle.dev->keybit, KEY_CNT))
+            return companion;
+    }
+    return NULL;
+}
+
+/*
+ * Start the macros held while a seat's output had nothing to inject
+ * into, see m720_macro_run(). Called once the output has a device.
+ */
+static void m720_output_kick(struct m720_output *output)
+{
+    struct m720_device *m720_dev;
+
+    mutex_lock(&m720_state_lock);
+    list_for_each_entry(m720_dev, &m720_devices, node) {
+        if (m720_dev->runner.output == output)
+            m720_macro_resume(&m720_dev->runner);
+    }
+    mutex_unlock(&m720_state_lock);
+}
+
+/*
+ * (Re)build a seat's output with the current key union. With
+ * companion_inject a real keyboard on the seat that has every key is
+ * used as is, and a virtual keyboard registered before it came along
+ * is dropped; a new one is built should the companion leave. Otherwise
+ * a replacement virtual keyboard is registered
+ * before it is swapped in and the old device is only unregistered once
+ * no runner can still be using it, so injection never has a gap.
+ */
+static void m720_output_rebuild(struct work_struct *work)
+{
+    struct m720_output *output =
+        container_of(work, struct m720_output, register_work);
+    DECLARE_BITMAP(keybit, KEY_CNT);
+    struct m720_companion *companion;
+    struct input_dev *virt_kbd, *old;
+
+    mutex_lock(&m720_config_lock);
+    bitmap_copy(keybit, m720_keybit, KEY_CNT);
+    mutex_unlock(&m720_config_lock);
+
+    if (companion_inject) {
+        mutex_lock(&m720_output_lock);
+        companion = m720_companion_pick(output->seat, keybit);
+        rcu_assign_pointer(output->companion,
+                           companion ? &companion->handle : NULL);
+        mutex_unlock(&m720_output_lock);
+
+        old = rcu_dereference_protected(output->dev, 1);
+        if (companion) {
+            m720_debug("Seat %s injects into %s\n", output->seat,
+                       companion->handle.dev->name ?: "Unknown");
+            if (old) {
+                RCU_INIT_POINTER(output->dev, NULL);
+                synchronize_rcu();
+                destroy_virtual_keyboard(old);
+            }
+            m720_output_kick(output);
+            return;
+        }
+    }
+
+    old = rcu_dereference_protected(output->dev, 1);
+    if (old && bitmap_subset(keybit, output->keybit, KEY_CNT))
         return;
-    
-    m720_debug("Event: type=%d, code=%d, value=%d\n", type, code, value);
-    
-    /* Only process key press events (value == 1) */
-    if (value != 1)
+
+    virt_kbd = create_virtual_keyboard(output, keybit);
+    if (!virt_kbd) {
+        printk(KERN_ERR MODULE_NAME ": No virtual keyboard for seat %s\n",
+               output->seat);
         return;
-    
-    /* Handle side buttons */
-    if (remap_side_buttons) {
-        switch (code) {
-        case BTN_SIDE:
-            m720_debug("Side button 1 pressed - sending workspace down\n");
-            send_key_combination(global_virtual_kbd, 
-                               WORKSPACE_DOWN_KEY1, WORKSPACE_DOWN_KEY2);
-            return; /* Don't forward original event */
-            
-        case BTN_EXTRA:
-            m720_debug("Side button 2 pressed - sending workspace up\n");
-            send_key_combination(global_virtual_kbd, 
-                               WORKSPACE_UP_KEY1, WORKSPACE_UP_KEY2);
-            return; /* Don't forward original event */
-        }
     }
-    
-    /* Handle forward/back buttons if enabled */
-    if (remap_extra_buttons) {
-        switch (code) {
-        case BTN_FORWARD:
-            m720_debug("Forward button pressed - sending Alt+Tab\n");
-            send_key_combination(global_virtual_kbd, KEY_LEFTALT, KEY_TAB);
-            return; /* Don't forward original event */
-            
-        case BTN_BACK:
-            m720_debug("Back button pressed - sending workspace down\n");
-            send_key_combination(global_virtual_kbd, 
-                               WORKSPACE_DOWN_KEY1, WORKSPACE_DOWN_KEY2);
-            return; /* Don't forward original event */
-        }
+
+    bitmap_copy(output->keybit, keybit, KEY_CNT);
+    rcu_assign_pointer(output->dev, virt_kbd);
+
+    if (old) {
+        synchronize_rcu();
+        destroy_virtual_keyboard(old);
+        m720_debug("Virtual keyboard for seat %s re-registered\n",
+                   output->seat);
+        return;
     }
-    
-    /* For all other events, let them pass through normally */
+    m720_output_kick(output);
 }
 
+#ifndef M720_FIXED_PROFILE
 /*
- * Filter function - determines if we should process this event
+ * Rebuild every output that lacks a key from the new union
  */
-static bool m720_filter(struct input_handle *handle, unsigned int type,
-                       unsigned int code, int value)
+static void m720_output_refresh(const unsigned long *keybit)
 {
-    /* We want to intercept and potentially block certain key events */
-    if (type == EV_KEY && value == 1) { /* Key press events only */
-        if (remap_side_buttons && 
-            (code == BTN_SIDE || code == BTN_EXTRA)) {
-            /* Block these events - we'll handle them ourselves */
-            m720_event(handle, type, code, value);
-            return true; /* true = filter out (don't pass through) */
-        }
-        
-        if (remap_extra_buttons && 
-            (code == BTN_FORWARD || code == BTN_BACK)) {
-            /* Block these events - we'll handle them ourselves */
-            m720_event(handle, type, code, value);
-            return true; /* true = filter out (don't pass through) */
-        }
+    struct m720_output *output;
+
+    mutex_lock(&m720_output_lock);
+    list_for_each_entry(output, &m720_outputs, node) {
+        if (output->users && !bitmap_subset(keybit, output->keybit, KEY_CNT))
+            schedule_work(&output->register_work);
     }
-    
-    return false; /* false = let event pass through normally */
+    mutex_unlock(&m720_output_lock);
 }
+#endif
 
 /*
- * Match function - determines if we should handle this device
+ * Find the virtual keyboard for a source device's seat and take a user
+ * reference, creating it on first use. An idle output still in its
+ * grace period is picked up again as is, catching up on any keys the
+ * keymaps gained meanwhile. Called from connect() with input_mutex held.
  */
-static bool m720_match(struct input_handler *handler, struct input_dev *dev)
+static struct m720_output *m720_output_get(struct input_dev *dev)
 {
-    return is_m720_device(dev);
+    struct m720_output *output;
+    char seat[M720_SEAT_LEN];
+
+    m720_seat_tag(dev, seat, sizeof(seat));
+
+    mutex_lock(&m720_output_lock);
+    list_for_each_entry(output, &m720_outputs, node) {
+        if (strcmp(output->seat, seat))
+            continue;
+        if (!output->users++)
+            schedule_work(&output->register_work);
+        goto out;
+    }
+
+    output = kzalloc(sizeof(*output), GFP_KERNEL);
+    if (!output)
+        goto out;
+
+    output->users = 1;
+    spin_lock_init(&output->lock);
+    strscpy(output->seat, seat, sizeof(output->seat));
+    snprintf(output->phys, sizeof(output->phys), "m720/%s/kbd", seat);
+    INIT_WORK(&output->register_work, m720_output_rebuild);
+    list_add_tail(&output->node, &m720_outputs);
+    schedule_work(&output->register_work);
+
+    m720_debug("New output for seat %s\n", seat);
+out:
+    mutex_unlock(&m720_output_lock);
+    return output;
 }
 
 /*
- * Connect to a new M720 device
+ * Drop a mouse's reference; the last one starts the output's grace
+ * period. NULL is ignored.
  */
-static int m720_connect(struct input_handler *handler, struct input_dev *dev,
-                       const struct input_device_id *id)
+static void m720_output_put(struct m720_output *output)
 {
-    struct m720_device *m720_dev;
-    struct input_handle *handle;
-    int error;
-    
-    /* Check if this is actually an M720 device */
-    if (!is_m720_device(dev)) {
-        m720_debug("Device %s is not an M720, skipping\n", 
-                  dev->name ?: "Unknown");
-        return -ENODEV;
+    unsigned int ms = READ_ONCE(output_grace_ms);
+
+    if (!output)
+        return;
+
+    mutex_lock(&m720_output_lock);
+    if (!--output->users) {
+        output->idle_at = jiffies;
+        m720_debug("Output for seat %s idle\n", output->seat);
+        /* An earlier expiry already armed covers this one too */
+        if (!delayed_work_pending(&m720_output_idle_work))
+            schedule_delayed_work(&m720_output_idle_work,
+                                  msecs_to_jiffies(ms));
     }
-    
-    printk(KERN_INFO MODULE_NAME ": Connecting to M720 device: %s\n", 
-           dev->name ?: "Unknown");
-    print_device_info(dev);
-    
-    /* Allocate memory for our device structure */
-    m720_dev = kzalloc(sizeof(struct m720_device), GFP_KERNEL);
-    if (!m720_dev) {
-        printk(KERN_ERR MODULE_NAME ": Failed to allocate device memory\n");
-        return -ENOMEM;
+    mutex_unlock(&m720_output_lock);
+}
+
+/*
+ * Tear down outputs idle for longer than output_grace_ms and re-arm for
+ * the next one to expire. Expired outputs are taken off the list under
+ * m720_output_lock, so no rebuild or companion change can find them
+ * once it is dropped.
+ */
+static void m720_output_expire(struct work_struct *work)
+{
+    unsigned long timeout = msecs_to_jiffies(READ_ONCE(output_grace_ms));
+    unsigned long next = 0;
+    struct m720_output *output, *tmp;
+    LIST_HEAD(expired);
+
+    mutex_lock(&m720_output_lock);
+    list_for_each_entry_safe(output, tmp, &m720_outputs, node) {
+        if (output->users)
+            continue;
+        if (time_before(jiffies, output->idle_at + timeout)) {
+            if (!next || time_before(output->idle_at + timeout, next))
+                next = output->idle_at + timeout;
+            continue;
+        }
+        list_move_tail(&output->node, &expired);
     }
-    
-    /* Initialize the handle */
-    handle = &m720_dev->handle;
-    handle->dev = dev;
-    handle->handler = handler;
-    handle->name = MODULE_NAME;
-    handle->private = m720_dev;
-    
-    /* Store device info */
-    snprintf(m720_dev->name, sizeof(m720_dev->name), "%s", 
-             dev->name ?: "M720");
-    snprintf(m720_dev->phys, sizeof(m720_dev->phys), "%s", 
-             dev->phys ?: "unknown");
-    
-    m720_dev->input_dev = dev;
-    m720_dev->enabled = true;
-    
-    /* Register the handle */
-    error = input_register_handle(handle);
-    if (error) {
-        printk(KERN_ERR MODULE_NAME ": Failed to register handle: %d\n", error);
-        kfree(m720_dev);
-        return error;
+    if (next)
+        schedule_delayed_work(&m720_output_idle_work, next - jiffies);
+    mutex_unlock(&m720_output_lock);
+
+    list_for_each_entry_safe(output, tmp, &expired, node) {
+        m720_debug("Output for seat %s expired\n", output->seat);
+        cancel_work_sync(&output->register_work);
+        destroy_virtual_keyboard(rcu_dereference_protected(output->dev, 1));
+        list_del(&output->node);
+        kfree(output);
     }
-    
-    /* Open the handle */
-    error = input_open_device(handle);
-    if (error) {
-        printk(KERN_ERR MODULE_NAME ": Failed to open device: %d\n", error);
-        input_unregister_handle(handle);
-        kfree(m720_dev);
-        return error;
+}
+
+/*
+ * Tear down every seat's virtual keyboard; runs after the handlers are
+ * gone. The list is taken private first as a rebuild still in flight
+ * needs m720_output_lock to finish.
+ */
+static void m720_output_destroy_all(void)
+{
+    struct m720_output *output, *tmp;
+    LIST_HEAD(outputs);
+
+    cancel_delayed_work_sync(&m720_output_idle_work);
+
+    mutex_lock(&m720_output_lock);
+    list_splice_init(&m720_outputs, &outputs);
+    mutex_unlock(&m720_output_lock);
+
+    list_for_each_entry_safe(output, tmp, &outputs, node) {
+        cancel_work_sync(&output->register_work);
+        destroy_virtual_keyboard(rcu_dereference_protected(output->dev, 1));
+        list_del(&output->node);
+        kfree(output);
     }
-    
-    device_count++;
-    printk(KERN_INFO MODULE_NAME ": Successfully connected to M720 device (total: %d)\n", 
-           device_count);
-    
-    return 0;
 }
 
 /*
- * Disconnect from M720 device
+ * Send one event to a seat's output: injected straight into its
+ * companion keyboard when one is bound, otherwise reported by its
+ * virtual keyboard. Called under rcu_read_lock().
  */
-static void m720_disconnect(struct input_handle *handle)
+static void m720_emit(struct m720_output *output, unsigned int type,
+                      unsigned int code, int value)
 {
-    struct m720_device *m720_dev = handle->private;
-    
-    printk(KERN_INFO MODULE_NAME ": Disconnecting from M720 device: %s\n",
-           m720_dev ? m720_dev->name : "Unknown");
-    
-    input_close_device(handle);
-    input_unregister_handle(handle);
-    
-    if (m720_dev) {
-        kfree(m720_dev);
-        device_count--;
+    struct input_handle *companion = rcu_dereference(output->companion);
+    struct input_dev *kbd;
+
+    if (companion) {
+        this_cpu_write(m720_injecting, true);
+        input_inject_event(companion, type, code, value);
+        this_cpu_write(m720_injecting, false);
+        return;
     }
-    
-    printk(KERN_INFO MODULE_NAME ": M720 device disconnected (remaining: %d)\n", 
-           device_count);
+
+    kbd = rcu_dereference(output->dev);
+    if (kbd)
+        input_event(kbd, type, code, value);
 }
 
-/* Input handler structure */
-static struct input_handler m720_handler = {
-    .filter     = m720_filter,
-    .match      = m720_match,
-    .connect    = m720_connect,
-    .disconnect = m720_disconnect,
-    .name       = MODULE_NAME,
-    .id_table   = m720_ids,
-};
+/*
+ * Event time of the frame a source event belongs to. Kernels before
+ * 5.4 do not expose it, so there it is the time the filter sees it.
+ */
+static ktime_t m720_frame_time(struct input_dev *dev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+    return input_get_timestamp(dev)[INPUT_CLK_MONO];
+#else
+    return ktime_get();
+#endif
+}
 
 /*
- * Module initialization
+ * End a frame on a runner's output. A virtual keyboard frame carries
+ * the source frame's time, advanced by the delays the macro has run
+ * through, instead of the time it is emitted. A companion keyboard's
+ * clock is left alone, as that device is not ours. Called with the
+ * output's lock held, see m720_macro_run().
  */
-static int __init m720_remapper_init(void)
+static void m720_emit_sync(struct m720_macro_runner *runner)
 {
-    int error;
-    
-    printk(KERN_INFO MODULE_NAME ": Loading Logitech M720 Button Remapper v%s\n", 
-           MODULE_VERSION);
-    printk(KERN_INFO MODULE_NAME ": Debug mode: %s\n", 
-           debug_mode ? "enabled" : "disabled");
-    printk(KERN_INFO MODULE_NAME ": Side button remapping: %s\n",
-           remap_side_buttons ? "enabled" : "disabled");
-    printk(KERN_INFO MODULE_NAME ": Extra button remapping: %s\n",
-           remap_extra_buttons ? "enabled" : "disabled");
-    
-    /* Create virtual keyboard */
-    global_virtual_kbd = create_virtual_keyboard();
-    if (!global_virtual_kbd) {
-        printk(KERN_ERR MODULE_NAME ": Failed to create virtual keyboard\n");
-        return -ENOMEM;
-    }
-    
-    /* Register input handler */
-    error = input_register_handler(&m720_handler);
-    if (error) {
-        printk(KERN_ERR MODULE_NAME ": Failed to register input handler: %d\n", error);
-        destroy_virtual_keyboard(global_virtual_kbd);
-        return error;
+    struct m720_output *output = runner->output;
+    struct input_dev *kbd = rcu_dereference(output->dev);
+    u8 slot = runner->head;
+
+    if (kbd && !rcu_access_pointer(output->companion)) {
+        if (msc_timestamp)
+            input_event(kbd, EV_MSC, MSC_TIMESTAMP,
+                        runner->msc[slot] +
+                        (u32)ktime_us_delta(runner->clock,
+                                            runner->stamp[slot]));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+        if (m720_config_snapshot()->preserve_timestamps)
+            input_set_timestamp(kbd, runner->clock);
+#endif
     }
-    
-    printk(KERN_INFO MODULE_NAME ": Module loaded successfully\n");
-    return 0;
+
+    m720_emit(output, EV_SYN, SYN_REPORT, 0);
 }
 
 /*
- * Module cleanup
+ * Companion keyboards: real keyboards our keys can be injected into
+ * with input_inject_event(), sparing the compositor a second evdev node.
+ * The handle is registered but never opened, so none of the keyboard's
+ * own events pass through us.
  */
-static void __exit m720_remapper_exit(void)
+static bool m720_companion_match(struct input_handler *handler,
+                                 struct input_dev *dev)
 {
-    printk(KERN_INFO MODULE_NAME ": Unloading module\n");
-    
-    /* Unregister input handler */
+    return !m720_is_own_device(dev) && !is_m720_device(dev);
+}
+
+static int m720_companion_connect(struct input_handler *handler,
+                                  struct input_dev *dev,
+                                  const struct input_device_id *id)
+{
+    struct m720_companion *companion;
+    struct m720_output *output;
+    int error;
+
+    companion = kzalloc(sizeof(*companion), GFP_KERNEL);
+    if (!companion)
+        return -ENOMEM;
+
+    companion->handle.dev = dev;
+    companion->handle.handler = handler;
+    companion->handle.name = MODULE_NAME "-companion";
+    companion->handle.private = companion;
+    m720_seat_tag(dev, companion->seat, sizeof(companion->seat));
+
+    error = input_register_handle(&companion->handle);
+    if (error) {
+        kfree(companion);
+        return error;
+    }
+
+    /* Let seats still on a virtual keyboard switch over */
+    mutex_lock(&m720_output_lock);
+    list_add_tail(&companion->node, &m720_companions);
+    list_for_each_entry(output, &m720_outputs, node) {
+        if (output->users && !rcu_access_pointer(output->companion) &&
+            !strcmp(output->seat, companion->seat))
+            schedule_work(&output->register_work);
+    }
+    mutex_unlock(&m720_output_lock);
+
+    m720_debug("Companion keyboard %s on seat %s\n",
+               dev->name ?: "Unknown", companion->seat);
+    return 0;
+}
+
+static void m720_companion_disconnect(struct input_handle *handle)
+{
+    struct m720_companion *companion = handle->private;
+    struct m720_output *output;
+
+    /* Seats injecting here fall back to another keyboard or a virtual one */
+    mutex_lock(&m720_output_lock);
+    list_del(&companion->node);
+    list_for_each_entry(output, &m720_outputs, node) {
+        if (rcu_access_pointer(output->companion) == handle) {
+            RCU_INIT_POINTER(output->companion, NULL);
+            schedule_work(&output->register_work);
+        }
+    }
+    mutex_unlock(&m720_output_lock);
+
+    synchronize_rcu();
+    input_unregister_handle(handle);
+    kfree(companion);
+}
+
+/*
+ * Modifier tracking: keyboards get a handle with an event callback that
+ * only counts modifier keys into m720_mod_count. Nothing is filtered,
+ * and every other key costs one compare.
+ */
+static const u16 m720_mod_keys[M720_MOD_KEYS] = {
+    KEY_LEFTCTRL, KEY_LEFTSHIFT, KEY_LEFTALT, KEY_LEFTMETA,
+    KEY_RIGHTCTRL, KEY_RIGHTSHIFT, KEY_RIGHTALT, KEY_RIGHTMETA,
+};
+
+/* The m720_mod_keys[] index of code, or M720_MOD_KEYS */
+static unsigned int m720_mod_index(unsigned int code)
+{
+    unsigned int i;
+
+    for (i = 0; i < M720_MOD_KEYS; i++) {
+        if (m720_mod_keys[i] == code)
+            break;
+    }
+    return i;
+}
+
+/*
+ * Modifiers held across the tracked keyboards, left and right folded
+ * into M720_MOD_* classes
+ */
+static u8 m720_mods(void)
+{
+    u64 count = atomic64_read(&m720_mod_count);
+    unsigned int i;
+    u8 held = 0;
+
+    if (!count)
+        return 0;
+
+    for (i = 0; i < M720_MOD_KEYS; i++) {
+        if ((count >> (8 * i)) & 0xff)
+            held |= BIT(i);
+    }
+    return (held | held >> 4) & 0xf;
+}
+
+static bool m720_tracker_match(struct input_handler *handler,
+                               struct input_dev *dev)
+{
+    if (m720_is_own_device(dev) || is_m720_device(dev))
+        return false;
+
+    return track_modifiers >= 2 || dev->id.vendor == LOGITECH_VENDOR_ID;
+}
+
+/*
+ * Called under the keyboard's event_lock, so held needs no locking of
+ * its own. A release without a press seen (held when we connected) is
+ * ignored, as are autorepeats.
+ */
+static void m720_tracker_event(struct input_handle *handle, unsigned int type,
+                               unsigned int code, int value)
+{
+    struct m720_tracker *tracker = handle->private;
+    unsigned int i;
+
+    if (type != EV_KEY || value == 2 || this_cpu_read(m720_injecting))
+        return;
+
+    i = m720_mod_index(code);
+    if (i == M720_MOD_KEYS || !value == !(tracker->held & BIT(i)))
+        return;
+
+    tracker->held ^= BIT(i);
+    if (value)
+        atomic64_add(1ULL << (8 * i), &m720_mod_count);
+    else
+        atomic64_sub(1ULL << (8 * i), &m720_mod_count);
+}
+
+static int m720_tracker_connect(struct input_handler *handler,
+                                struct input_dev *dev,
+                                const struct input_device_id *id)
+{
+    struct m720_tracker *tracker;
+    int error;
+
+    tracker = kzalloc(sizeof(*tracker), GFP_KERNEL);
+    if (!tracker)
+        return -ENOMEM;
+
+    tracker->handle.dev = dev;
+    tracker->handle.handler = handler;
+    tracker->handle.name = MODULE_NAME "-modifiers";
+    tracker->handle.private = tracker;
+
+    error = input_register_handle(&tracker->handle);
+    if (error)
+        goto err_free;
+
+    error = input_open_device(&tracker->handle);
+    if (error)
+        goto err_unregister;
+
+    m720_debug("Tracking modifiers on %s\n", dev->name ?: "Unknown");
+    return 0;
+
+err_unregister:
+    input_unregister_handle(&tracker->handle);
+err_free:
+    kfree(tracker);
+    return error;
+}
+
+static void m720_tracker_disconnect(struct input_handle *handle)
+{
+    struct m720_tracker *tracker = handle->private;
+    unsigned int i;
+
+    input_close_device(handle);
+    input_unregister_handle(handle);
+
+    /* No more events: drop whatever this keyboard still held */
+    for (i = 0; i < M720_MOD_KEYS; i++) {
+        if (tracker->held & BIT(i))
+            atomic64_sub(1ULL << (8 * i), &m720_mod_count);
+    }
+    kfree(tracker);
+}
+
+/*
+ * Key and button names accepted in the keymap parameter
+ */
+struct m720_name {
+    const char *name;
+    u16 code;
+};
+
+static const struct m720_name m720_button_names[] = {
+    { "left",    BTN_LEFT },
+    { "right",   BTN_RIGHT },
+    { "middle",  BTN_MIDDLE },
+    { "side",    BTN_SIDE },
+    { "extra",   BTN_EXTRA },
+    { "forward", BTN_FORWARD },
+    { "back",    BTN_BACK },
+    { "task",    BTN_TASK },
+};
+
+static const struct m720_name m720_key_names[] = {
+    { "leftctrl", KEY_LEFTCTRL },   { "rightctrl", KEY_RIGHTCTRL },
+    { "leftshift", KEY_LEFTSHIFT }, { "rightshift", KEY_RIGHTSHIFT },
+    { "leftalt", KEY_LEFTALT },     { "rightalt", KEY_RIGHTALT },
+    { "leftmeta", KEY_LEFTMETA },   { "rightmeta", KEY_RIGHTMETA },
+    { "ctrl", KEY_LEFTCTRL },       { "shift", KEY_LEFTSHIFT },
+    { "alt", KEY_LEFTALT },         { "super", KEY_LEFTMETA },
+    { "meta", KEY_LEFTMETA },
+    { "up", KEY_UP },               { "down", KEY_DOWN },
+    { "left", KEY_LEFT },           { "right", KEY_RIGHT },
+    { "pageup", KEY_PAGEUP },       { "pagedown", KEY_PAGEDOWN },
+    { "home", KEY_HOME },           { "end", KEY_END },
+    { "insert", KEY_INSERT },       { "delete", KEY_DELETE },
+    { "enter", KEY_ENTER },         { "esc", KEY_ESC },
+    { "tab", KEY_TAB },             { "space", KEY_SPACE },
+    { "backspace", KEY_BACKSPACE }, { "print", KEY_SYSRQ },
+    { "minus", KEY_MINUS },         { "equal", KEY_EQUAL },
+    { "a", KEY_A }, { "b", KEY_B }, { "c", KEY_C }, { "d", KEY_D },
+    { "e", KEY_E }, { "f", KEY_F }, { "g", KEY_G }, { "h", KEY_H },
+    { "i", KEY_I }, { "j", KEY_J }, { "k", KEY_K }, { "l", KEY_L },
+    { "m", KEY_M }, { "n", KEY_N }, { "o", KEY_O }, { "p", KEY_P },
+    { "q", KEY_Q }, { "r", KEY_R }, { "s", KEY_S }, { "t", KEY_T },
+    { "u", KEY_U }, { "v", KEY_V }, { "w", KEY_W }, { "x", KEY_X },
+    { "y", KEY_Y }, { "z", KEY_Z },
+    { "1", KEY_1 }, { "2", KEY_2 }, { "3", KEY_3 }, { "4", KEY_4 },
+    { "5", KEY_5 }, { "6", KEY_6 }, { "7", KEY_7 }, { "8", KEY_8 },
+    { "9", KEY_9 }, { "0", KEY_0 },
+    { "f1", KEY_F1 },   { "f2", KEY_F2 },   { "f3", KEY_F3 },
+    { "f4", KEY_F4 },   { "f5", KEY_F5 },   { "f6", KEY_F6 },
+    { "f7", KEY_F7 },   { "f8", KEY_F8 },   { "f9", KEY_F9 },
+    { "f10", KEY_F10 }, { "f11", KEY_F11 }, { "f12", KEY_F12 },
+    { "mute", KEY_MUTE },                 { "volumeup", KEY_VOLUMEUP },
+    { "volumedown", KEY_VOLUMEDOWN },     { "playpause", KEY_PLAYPAUSE },
+    { "nextsong", KEY_NEXTSONG },         { "previoussong", KEY_PREVIOUSSONG },
+    { "stop", KEY_STOPCD },               { "browserback", KEY_BACK },
+    { "browserforward", KEY_FORWARD },
+};
+
+static int m720_lookup_name(const struct m720_name *table, size_t count,
+                            const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!strcasecmp(table[i].name, name))
+            return table[i].code;
+    }
+    return -EINVAL;
+}
+
+/*
+ * Resolve a key token: a name from m720_key_names or a raw decimal code
+ */
+static int m720_parse_key(const char *token)
+{
+    unsigned int code;
+
+    if (!kstrtouint(token, 10, &code))
+        return (code && code < KEY_CNT) ? code : -EINVAL;
+
+    return m720_lookup_name(m720_key_names, ARRAY_SIZE(m720_key_names),
+                            token);
+}
+
+#ifndef M720_FIXED_PROFILE
+static int m720_add_step(struct m720_macro *macro, u16 op, u16 arg)
+{
+    if (macro->len >= M720_MACRO_MAX_STEPS)
+        return -E2BIG;
+
+    macro->steps[macro->len].op = op;
+    macro->steps[macro->len].arg = arg;
+    macro->len++;
+    return 0;
+}
+
+/*
+ * Compile one macro, e.g. "leftctrl+leftmeta+down,20ms,enter".
+ *
+ * Each chord expands to press-all, sync, hold, release-in-reverse, sync,
+ * so every compiled macro leaves the keys it touched released.
+ * "layer:N" (while held) and "toggle:N" make a layer key instead and
+ * must stand alone.
+ */
+static int m720_compile_macro(char *spec, struct m720_macro *macro)
+{
+    u16 chord[M720_CHORD_MAX_KEYS];
+    unsigned int delay, layer;
+    bool layer_key = false;
+    char *token, *key;
+    size_t len;
+    int code, count, i, error = 0;
+
+    macro->len = 0;
+
+    while ((token = strsep(&spec, ", ")) != NULL) {
+        if (!*token)
+            continue;
+
+        if (!strncasecmp(token, "layer:", 6) ||
+            !strncasecmp(token, "toggle:", 7)) {
+            if (macro->len ||
+                kstrtouint(strchr(token, ':') + 1, 10, &layer) ||
+                layer >= M720_MAX_PROFILES)
+                return -EINVAL;
+            layer_key = true;
+            error = m720_add_step(macro, tolower(*token) == 'l' ?
+                                  M720_STEP_LAYER : M720_STEP_TOGGLE, layer);
+            if (error)
+                return error;
+            continue;
+        }
+
+        len = strlen(token);
+        if (len > 2 && !strcasecmp(token + len - 2, "ms")) {
+            token[len - 2] = '\0';
+            if (kstrtouint(token, 10, &delay) ||
+                delay > M720_MACRO_MAX_DELAY_MS)
+                return -EINVAL;
+            error = m720_add_step(macro, M720_STEP_DELAY, delay);
+            if (error)
+                return error;
+            continue;
+        }
+
+        count = 0;
+        while ((key = strsep(&token, "+")) != NULL) {
+            if (count == M720_CHORD_MAX_KEYS)
+                return -E2BIG;
+            code = m720_parse_key(key);
+            if (code < 0)
+                return code;
+            chord[count++] = code;
+        }
+
+        for (i = 0; i < count && !error; i++)
+            error = m720_add_step(macro, M720_STEP_PRESS, chord[i]);
+        if (!error)
+            error = m720_add_step(macro, M720_STEP_SYNC, 0);
+        if (!error)
+            error = m720_add_step(macro, M720_STEP_DELAY, M720_CHORD_HOLD_MS);
+        for (i = count - 1; i >= 0 && !error; i--)
+            error = m720_add_step(macro, M720_STEP_RELEASE, chord[i]);
+        if (!error)
+            error = m720_add_step(macro, M720_STEP_SYNC, 0);
+        if (error)
+            return error;
+    }
+
+    return layer_key && macro->len != 1 ? -EINVAL : 0;
+}
+
+/*
+ * Collect the keys a compiled macro presses
+ */
+static void m720_macro_keys(const struct m720_macro *macro,
+                            unsigned long *keybit)
+{
+    u8 i;
+
+    for (i = 0; i < macro->len; i++) {
+        if (macro->steps[i].op == M720_STEP_PRESS)
+            __set_bit(macro->steps[i].arg, keybit);
+    }
+}
+
+static const struct m720_name m720_wheel_names[] = {
+    { "wheel_up",    M720_WHEEL_UP },
+    { "wheel_down",  M720_WHEEL_DOWN },
+    { "wheel_left",  M720_WHEEL_LEFT },
+    { "wheel_right", M720_WHEEL_RIGHT },
+};
+
+/* Modifier classes for chords and programs; super is meta */
+static const struct m720_name m720_mod_names[] = {
+    { "ctrl",  M720_MOD_CTRL },
+    { "shift", M720_MOD_SHIFT },
+    { "alt",   M720_MOD_ALT },
+    { "meta",  M720_MOD_META },
+    { "super", M720_MOD_META },
+};
+
+/*
+ * Strip "mod+mod+" from the front of a keymap entry name and return the
+ * M720_MOD_* classes it names, or -EINVAL
+ */
+static int m720_parse_mods(char **entry)
+{
+    char *plus;
+    int mod, mods = 0;
+
+    while ((plus = strchr(*entry, '+')) != NULL) {
+        *plus = '\0';
+        mod = m720_lookup_name(m720_mod_names, ARRAY_SIZE(m720_mod_names),
+                               strim(*entry));
+        if (mod < 0)
+            return mod;
+        mods |= mod;
+        *entry = strim(plus + 1);
+    }
+    return mods;
+}
+
+static const struct m720_name m720_gesture_names[] = {
+    { "gesture_left",  M720_GESTURE_LEFT },
+    { "gesture_right", M720_GESTURE_RIGHT },
+    { "gesture_up",    M720_GESTURE_UP },
+    { "gesture_down",  M720_GESTURE_DOWN },
+};
+
+/*
+ * Compile a keymap, e.g. "side=leftmeta+pagedown;forward=leftalt+tab".
+ * Buttons without an entry are passed through untouched. "gesture=task"
+ * makes a button the gesture button, and gesture_left..gesture_down
+ * give the swipe actions; the button's own entry is its tap action.
+ * wheel_up..wheel_right map wheel notches and tilts. "ctrl+side" maps a
+ * chord with modifiers held on a keyboard, see track_modifiers.
+ */
+static struct m720_keymap *m720_compile_keymap(const char *spec)
+{
+    struct m720_keymap *keymap;
+    char *buf, *cur, *entry, *macro;
+    int button, dir, mods, error = 0;
+
+    if (strlen(spec) >= M720_KEYMAP_SPEC_LEN)
+        return ERR_PTR(-E2BIG);
+
+    keymap = kzalloc(sizeof(*keymap), GFP_KERNEL);
+    buf = kstrdup(spec, GFP_KERNEL);
+    if (!keymap || !buf) {
+        error = -ENOMEM;
+        goto out;
+    }
+
+    cur = strim(buf);
+    strscpy(keymap->spec, cur, sizeof(keymap->spec));
+
+    while ((entry = strsep(&cur, ";")) != NULL) {
+        entry = strim(entry);
+        if (!*entry)
+            continue;
+
+        macro = strchr(entry, '=');
+        if (!macro) {
+            error = -EINVAL;
+            break;
+        }
+        *macro++ = '\0';
+        entry = strim(entry);
+
+        if (!strcasecmp(entry, "gesture")) {
+            button = m720_lookup_name(m720_button_names,
+                                      ARRAY_SIZE(m720_button_names),
+                                      strim(macro));
+            if (button < 0) {
+                error = button;
+                break;
+            }
+            keymap->gesture_button = button;
+            continue;
+        }
+
+        dir = m720_lookup_name(m720_gesture_names,
+                               ARRAY_SIZE(m720_gesture_names), entry);
+        if (dir >= 0) {
+            error = m720_compile_macro(macro, &keymap->gesture[dir]);
+            if (error)
+                break;
+            m720_macro_keys(&keymap->gesture[dir], keymap->keybit);
+            continue;
+        }
+
+        dir = m720_lookup_name(m720_wheel_names,
+                               ARRAY_SIZE(m720_wheel_names), entry);
+        if (dir >= 0) {
+            error = m720_compile_macro(macro, &keymap->wheel[dir]);
+            if (error)
+                break;
+            m720_macro_keys(&keymap->wheel[dir], keymap->keybit);
+            continue;
+        }
+
+        mods = m720_parse_mods(&entry);
+        if (mods < 0) {
+            error = mods;
+            break;
+        }
+
+        button = m720_lookup_name(m720_button_names,
+                                  ARRAY_SIZE(m720_button_names), entry);
+        if (button < 0) {
+            error = button;
+            break;
+        }
+
+        if (mods) {
+            struct m720_chord *chord = &keymap->chord[keymap->chords];
+
+            if (keymap->chords >= M720_MAX_CHORDS) {
+                error = -E2BIG;
+                break;
+            }
+            error = m720_compile_macro(macro, &chord->macro);
+            if (error)
+                break;
+            /* Layer keys stay plain buttons */
+            if (chord->macro.steps[0].op >= M720_STEP_LAYER) {
+                error = -EINVAL;
+                break;
+            }
+            chord->button = button - BTN_MOUSE;
+            chord->mods = mods;
+            keymap->chords++;
+            keymap->chord_buttons |= BIT(chord->button);
+            m720_macro_keys(&chord->macro, keymap->keybit);
+            continue;
+        }
+
+        error = m720_compile_macro(macro,
+                                   &keymap->action[button - BTN_MOUSE]);
+        if (error)
+            break;
+        m720_macro_keys(&keymap->action[button - BTN_MOUSE], keymap->keybit);
+    }
+
+out:
+    kfree(buf);
+    if (error) {
+        printk(KERN_ERR MODULE_NAME ": Invalid keymap \"%s\": %d\n",
+               spec, error);
+        kfree(keymap);
+        return ERR_PTR(error);
+    }
+    return keymap;
+}
+
+static const unsigned int m720_profile_ids[M720_MAX_PROFILES] = { 0, 1, 2, 3 };
+
+/*
+ * Snapshot the event-path parameters into a fresh config and publish
+ * it. Readers see the old snapshot or the new one, never a mix.
+ */
+static int m720_config_publish(void)
+{
+    struct m720_config *cfg, *old;
+
+    cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
+    if (!cfg)
+        return -ENOMEM;
+
+    cfg->remap_side = remap_side_buttons;
+    cfg->remap_extra = remap_extra_buttons;
+    cfg->preserve_timestamps = preserve_timestamps;
+    cfg->rate_limit = rate_limit;
+    cfg->rate_burst = rate_burst;
+    memcpy(cfg->debounce_ms, debounce_ms, sizeof(cfg->debounce_ms));
+    cfg->kinetic_scroll = kinetic_scroll;
+    cfg->scroll_friction = min(scroll_friction, 1000u);
+    cfg->pointer_transform = pointer_transform;
+    m720_xform_setup(&cfg->xform, pointer_scale, accel_curve, accel_points,
+                     angle_snap);
+    cfg->gesture_threshold = max(gesture_threshold, 1u);
+
+    mutex_lock(&m720_config_lock);
+    old = rcu_replace_pointer(m720_config, cfg,
+                              lockdep_is_held(&m720_config_lock));
+    mutex_unlock(&m720_config_lock);
+
+    if (old)
+        kfree_rcu(old, rcu);
+    return 0;
+}
+
+/*
+ * Recompute the union of the keys the keymaps and the program press.
+ * Must be called with m720_config_lock held.
+ */
+static void m720_keybit_update(void)
+{
+    struct m720_keymap *keymap;
+    struct m720_program *prog;
+    unsigned int i;
+
+    bitmap_zero(m720_keybit, KEY_CNT);
+    for (i = 0; i < M720_MAX_PROFILES; i++) {
+        keymap = rcu_dereference_protected(m720_profiles[i],
+                                           lockdep_is_held(&m720_config_lock));
+        if (keymap)
+            bitmap_or(m720_keybit, m720_keybit, keymap->keybit, KEY_CNT);
+    }
+
+    prog = rcu_dereference_protected(m720_program,
+                                     lockdep_is_held(&m720_config_lock));
+    if (prog)
+        bitmap_or(m720_keybit, m720_keybit, prog->keybit, KEY_CNT);
+}
+
+static int m720_profile_store(unsigned int slot, const char *val)
+{
+    struct m720_keymap *keymap, *old;
+    DECLARE_BITMAP(keybit, KEY_CNT);
+
+    keymap = m720_compile_keymap(val);
+    if (IS_ERR(keymap))
+        return PTR_ERR(keymap);
+
+    mutex_lock(&m720_config_lock);
+    old = rcu_replace_pointer(m720_profiles[slot], keymap,
+                              lockdep_is_held(&m720_config_lock));
+    m720_keybit_update();
+    bitmap_copy(keybit, m720_keybit, KEY_CNT);
+    mutex_unlock(&m720_config_lock);
+
+    /* Outside m720_config_lock: rebuild work takes it */
+    m720_output_refresh(keybit);
+
+    if (old)
+        kfree_rcu(old, rcu);
+    return 0;
+}
+
+static int m720_keymap_set(const char *val, const struct kernel_param *kp)
+{
+    return m720_profile_store(*(const unsigned int *)kp->arg, val);
+}
+
+static int m720_keymap_get(char *buffer, const struct kernel_param *kp)
+{
+    struct m720_keymap *keymap;
+    int len;
+
+    rcu_read_lock();
+    keymap = rcu_dereference(m720_profiles[*(const unsigned int *)kp->arg]);
+    len = scnprintf(buffer, PAGE_SIZE, "%s\n", keymap ? keymap->spec : "");
+    rcu_read_unlock();
+    return len;
+}
+
+static const struct kernel_param_ops m720_keymap_ops = {
+    .set = m720_keymap_set,
+    .get = m720_keymap_get,
+};
+
+module_param_cb(keymap, &m720_keymap_ops, &m720_profile_ids[0], 0644);
+MODULE_PARM_DESC(keymap, "Button macros for profile 0, e.g. \"side=leftctrl+leftmeta+down,20ms,enter;back=leftalt+tab\"");
+module_param_cb(keymap1, &m720_keymap_ops, &m720_profile_ids[1], 0644);
+MODULE_PARM_DESC(keymap1, "Button macros for profile 1");
+module_param_cb(keymap2, &m720_keymap_ops, &m720_profile_ids[2], 0644);
+MODULE_PARM_DESC(keymap2, "Button macros for profile 2");
+module_param_cb(keymap3, &m720_keymap_ops, &m720_profile_ids[3], 0644);
+MODULE_PARM_DESC(keymap3, "Button macros for profile 3");
+
+/*
+ * Mapping programs: a small bytecode run on every button event before
+ * the keymap, for logic tables cannot express. The program parameter
+ * takes it in assembly form, one instruction per ';' or line, with
+ * "label:" prefixes as jump targets:
+ *
+ *   ld r0, code; jne r0, side, done; ld r0, value; jne r0, 1, skip;
+ *   ldm r1, 0; xor r1, 1; stm 0, r1; jeq r1, 0, other;
+ *   run extra; exit drop; other: run forward; skip: exit drop; done:
+ *
+ * makes the thumb button alternate between the extra and forward
+ * buttons' actions.
+ * It is compiled, then verified before it is published.
+ */
+static const struct m720_name m720_ctx_names[] = {
+    { "code",    M720_CTX_CODE },
+    { "value",   M720_CTX_VALUE },
+    { "buttons", M720_CTX_BUTTONS },
+    { "layer",   M720_CTX_LAYER },
+    { "profile", M720_CTX_PROFILE },
+    { "mods",    M720_CTX_MODS },
+};
+
+static const struct m720_name m720_exit_names[] = {
+    { "next", M720_PROG_NEXT },
+    { "pass", M720_PROG_PASS },
+    { "drop", M720_PROG_DROP },
+};
+
+static const struct m720_mnemonic m720_mnemonics[] = {
+    { "mov",     M720_OP_MOV,     { M720_ARG_DST, M720_ARG_SRC } },
+    { "add",     M720_OP_ADD,     { M720_ARG_DST, M720_ARG_SRC } },
+    { "sub",     M720_OP_SUB,     { M720_ARG_DST, M720_ARG_SRC } },
+    { "and",     M720_OP_AND,     { M720_ARG_DST, M720_ARG_SRC } },
+    { "or",      M720_OP_OR,      { M720_ARG_DST, M720_ARG_SRC } },
+    { "xor",     M720_OP_XOR,     { M720_ARG_DST, M720_ARG_SRC } },
+    { "ld",      M720_OP_LD,      { M720_ARG_DST, M720_ARG_CTX } },
+    { "ldm",     M720_OP_LDM,     { M720_ARG_DST, M720_ARG_SLOT } },
+    { "stm",     M720_OP_STM,     { M720_ARG_SLOT, M720_ARG_SRC } },
+    { "ja",      M720_OP_JA,      { M720_ARG_LABEL } },
+    { "jeq",     M720_OP_JEQ,     { M720_ARG_DST, M720_ARG_SRC, M720_ARG_LABEL } },
+    { "jne",     M720_OP_JNE,     { M720_ARG_DST, M720_ARG_SRC, M720_ARG_LABEL } },
+    { "jgt",     M720_OP_JGT,     { M720_ARG_DST, M720_ARG_SRC, M720_ARG_LABEL } },
+    { "jlt",     M720_OP_JLT,     { M720_ARG_DST, M720_ARG_SRC, M720_ARG_LABEL } },
+    { "jset",    M720_OP_JSET,    { M720_ARG_DST, M720_ARG_SRC, M720_ARG_LABEL } },
+    { "repeat",  M720_OP_REPEAT,  { M720_ARG_NUM } },
+    { "end",     M720_OP_END },
+    { "press",   M720_OP_PRESS,   { M720_ARG_KEY } },
+    { "release", M720_OP_RELEASE, { M720_ARG_KEY } },
+    { "tap",     M720_OP_TAP,     { M720_ARG_KEY } },
+    { "sync",    M720_OP_SYNC },
+    { "delay",   M720_OP_DELAY,   { M720_ARG_NUM } },
+    { "run",     M720_OP_RUN,     { M720_ARG_BUTTON } },
+    { "exit",    M720_OP_EXIT,    { M720_ARG_EXIT } },
+};
+
+/*
+ * Parse one operand into insn. Only the syntax is checked here; ranges
+ * are the verifier's job.
+ */
+static int m720_prog_operand(const struct m720_prog_parse *parse,
+                             struct m720_insn *insn, u8 kind, char *tok)
+{
+    unsigned int i;
+    u8 reg;
+    int val;
+
+    switch (kind) {
+    case M720_ARG_DST:
+        if (tolower(*tok) != 'r' || kstrtou8(tok + 1, 10, &reg))
+            return -EINVAL;
+        insn->dst = reg;
+        return 0;
+    case M720_ARG_SRC:
+        if (tolower(*tok) == 'r' && !kstrtou8(tok + 1, 10, &reg)) {
+            insn->src = reg;
+            return 0;
+        }
+        if (kstrtoint(tok, 0, &val)) {
+            /* A button name stands for its BTN_* code, ctrl etc. for M720_MOD_* */
+            val = m720_lookup_name(m720_button_names,
+                                   ARRAY_SIZE(m720_button_names), tok);
+            if (val < 0)
+                val = m720_lookup_name(m720_mod_names,
+                                       ARRAY_SIZE(m720_mod_names), tok);
+            if (val < 0)
+                return val;
+        }
+        insn->src = M720_PROG_IMM;
+        insn->imm = val;
+        return 0;
+    case M720_ARG_LABEL:
+        for (i = 0; i < parse->labels; i++) {
+            if (!strcmp(parse->label[i], tok)) {
+                insn->aux = parse->label_at[i];
+                return 0;
+            }
+        }
+        return -EINVAL;
+    case M720_ARG_CTX:
+        val = m720_lookup_name(m720_ctx_names, ARRAY_SIZE(m720_ctx_names),
+                               tok);
+        if (val < 0)
+            return val;
+        insn->aux = val;
+        return 0;
+    case M720_ARG_SLOT:
+        return kstrtou8(tok, 10, &insn->aux);
+    case M720_ARG_NUM:
+        return kstrtoint(tok, 10, &insn->imm);
+    case M720_ARG_KEY:
+        val = m720_parse_key(tok);
+        break;
+    case M720_ARG_BUTTON:
+        val = m720_lookup_name(m720_button_names,
+                               ARRAY_SIZE(m720_button_names), tok);
+        break;
+    case M720_ARG_EXIT:
+        val = m720_lookup_name(m720_exit_names, ARRAY_SIZE(m720_exit_names),
+                               tok);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (val < 0)
+        return val;
+    insn->imm = val;
+    return 0;
+}
+
+/*
+ * Parse one statement, "mnemonic operand, operand, ...", into insn
+ */
+static int m720_prog_insn(const struct m720_prog_parse *parse,
+                          struct m720_insn *insn, char *stmt)
+{
+    const struct m720_mnemonic *mn = NULL;
+    char *name, *tok;
+    unsigned int i;
+    int error;
+
+    name = strsep(&stmt, " \t");
+    for (i = 0; i < ARRAY_SIZE(m720_mnemonics); i++) {
+        if (!strcasecmp(m720_mnemonics[i].name, name)) {
+            mn = &m720_mnemonics[i];
+            break;
+        }
+    }
+    if (!mn)
+        return -EINVAL;
+
+    insn->op = mn->op;
+    insn->src = M720_PROG_IMM;
+
+    for (i = 0; i < ARRAY_SIZE(mn->args); i++) {
+        do {
+            tok = strsep(&stmt, ", \t");
+        } while (tok && !*tok);
+
+        if (mn->args[i] == M720_ARG_NONE)
+            return tok ? -EINVAL : 0;
+        if (!tok)
+            return -EINVAL;
+
+        error = m720_prog_operand(parse, insn, mn->args[i], tok);
+        if (error)
+            return error;
+    }
+
+    /* Nothing may follow the last operand */
+    while ((tok = strsep(&stmt, ", \t")) != NULL) {
+        if (*tok)
+            return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * Check a compiled program before it can run: registers, slots, context
+ * fields, keys and counts in range, repeat blocks matched and at most
+ * M720_PROG_MAX_DEPTH deep, and jumps only forward within their own
+ * block. Those rules leave the bounded repeats as the only way back, so
+ * every program terminates; the worst case instruction count over all
+ * paths is computed and must stay within M720_PROG_MAX_COST.
+ */
+static int m720_prog_verify(struct m720_program *prog)
+{
+    unsigned int cost[M720_PROG_MAX_DEPTH + 1];
+    unsigned int open[M720_PROG_MAX_DEPTH];
+    u8 block[M720_PROG_MAX_INSNS];  /* enclosing repeat + 1, 0 at top level */
+    unsigned int depth = 0, body, i;
+    struct m720_insn *insn;
+
+    cost[0] = 0;
+    for (i = 0; i < prog->len; i++) {
+        insn = &prog->insn[i];
+        block[i] = depth ? open[depth - 1] + 1 : 0;
+
+        if (insn->dst >= M720_PROG_REGS ||
+            (insn->src != M720_PROG_IMM && insn->src >= M720_PROG_REGS))
+            return -EINVAL;
+
+        switch (insn->op) {
+        case M720_OP_MOV ... M720_OP_XOR:
+        case M720_OP_JA ... M720_OP_JSET:
+        case M720_OP_SYNC:
+            break;
+        case M720_OP_LD:
+            if (insn->aux >= M720_CTX_FIELDS)
+                return -EINVAL;
+            break;
+        case M720_OP_LDM:
+        case M720_OP_STM:
+            if (insn->aux >= M720_PROG_SCRATCH)
+                return -EINVAL;
+            break;
+        case M720_OP_REPEAT:
+            if (insn->imm < 1 || insn->imm > M720_PROG_MAX_REPEAT ||
+                depth >= M720_PROG_MAX_DEPTH)
+                return -EINVAL;
+            cost[depth]++;
+            open[depth++] = i;
+            cost[depth] = 0;
+            continue;
+        case M720_OP_END:
+            if (!depth)
+                return -EINVAL;
+            body = cost[depth] + 1;
+            depth--;
+            prog->insn[open[depth]].aux = i;
+            cost[depth] += body * prog->insn[open[depth]].imm;
+            continue;
+        case M720_OP_PRESS:
+        case M720_OP_TAP:
+            if (insn->imm <= 0 || insn->imm >= KEY_CNT)
+                return -EINVAL;
+            __set_bit(insn->imm, prog->keybit);
+            break;
+        case M720_OP_RELEASE:
+            if (insn->imm <= 0 || insn->imm >= KEY_CNT)
+                return -EINVAL;
+            break;
+        case M720_OP_DELAY:
+            if (insn->imm < 0 || insn->imm > M720_MACRO_MAX_DELAY_MS)
+                return -EINVAL;
+            break;
+        case M720_OP_RUN:
+            if (insn->imm < BTN_MOUSE ||
+                insn->imm >= BTN_MOUSE + M720_NUM_BUTTONS)
+                return -EINVAL;
+            break;
+        case M720_OP_EXIT:
+            if (insn->imm < M720_PROG_NEXT || insn->imm > M720_PROG_DROP)
+                return -EINVAL;
+            break;
+        default:
+            return -EINVAL;
+        }
+        cost[depth]++;
+    }
+    if (depth)
+        return -EINVAL;
+
+    /* Block ids are complete now: check the jumps against them */
+    for (i = 0; i < prog->len; i++) {
+        insn = &prog->insn[i];
+        if (insn->op < M720_OP_JA || insn->op > M720_OP_JSET)
+            continue;
+        if (insn->aux <= i || insn->aux > prog->len)
+            return -EINVAL;
+        if (insn->aux == prog->len && block[i])
+            return -EINVAL;
+        if (insn->aux < prog->len && block[insn->aux] != block[i])
+            return -EINVAL;
+    }
+
+    if (cost[0] > M720_PROG_MAX_COST)
+        return -E2BIG;
+    prog->cost = cost[0];
+    return 0;
+}
+
+/*
+ * Compile and verify the program parameter. Labels are collected in a
+ * first pass so jumps can go forward to them.
+ */
+static struct m720_program *m720_compile_program(const char *spec)
+{
+    struct m720_prog_parse *parse;
+    struct m720_program *prog;
+    char *buf, *cur, *stmt, *colon;
+    unsigned int count = 0, i;
+    int error = 0;
+
+    if (strlen(spec) >= M720_PROG_SPEC_LEN)
+        return ERR_PTR(-E2BIG);
+
+    prog = kzalloc(sizeof(*prog), GFP_KERNEL);
+    parse = kzalloc(sizeof(*parse), GFP_KERNEL);
+    buf = kstrdup(spec, GFP_KERNEL);
+    if (!prog || !parse || !buf) {
+        error = -ENOMEM;
+        goto out;
+    }
+
+    cur = strim(buf);
+    strscpy(prog->spec, cur, sizeof(prog->spec));
+
+    while ((stmt = strsep(&cur, ";\n")) != NULL) {
+        stmt = strim(stmt);
+        colon = strchr(stmt, ':');
+        if (colon) {
+            *colon = '\0';
+            stmt = strim(stmt);
+            if (!*stmt || strlen(stmt) >= M720_PROG_LABEL_LEN ||
+                parse->labels >= M720_PROG_MAX_INSNS) {
+                error = -EINVAL;
+                goto out;
+            }
+            for (i = 0; i < parse->labels; i++) {
+                if (!strcmp(parse->label[i], stmt)) {
+                    error = -EINVAL;
+                    goto out;
+                }
+            }
+            parse->label[parse->labels] = stmt;
+            parse->label_at[parse->labels++] = count;
+            stmt = strim(colon + 1);
+        }
+        if (!*stmt)
+            continue;
+        if (count >= M720_PROG_MAX_INSNS) {
+            error = -E2BIG;
+            goto out;
+        }
+        parse->stmt[count++] = stmt;
+    }
+
+    for (i = 0; i < count; i++) {
+        error = m720_prog_insn(parse, &prog->insn[i], parse->stmt[i]);
+        if (error)
+            goto out;
+    }
+    prog->len = count;
+
+    error = m720_prog_verify(prog);
+
+out:
+    kfree(buf);
+    kfree(parse);
+    if (error) {
+        printk(KERN_ERR MODULE_NAME ": Invalid program \"%s\": %d\n",
+               spec, error);
+        kfree(prog);
+        return ERR_PTR(error);
+    }
+    return prog;
+}
+
+/*
+ * An empty value unloads the program
+ */
+static int m720_program_set(const char *val, const struct kernel_param *kp)
+{
+    struct m720_program *prog = NULL, *old;
+    DECLARE_BITMAP(keybit, KEY_CNT);
+    char *spec;
+
+    spec = kstrdup(val, GFP_KERNEL);
+    if (!spec)
+        return -ENOMEM;
+    if (*strim(spec))
+        prog = m720_compile_program(spec);
+    kfree(spec);
+    if (IS_ERR(prog))
+        return PTR_ERR(prog);
+
+    mutex_lock(&m720_config_lock);
+    if (prog)
+        prog->gen = ++m720_program_gen;
+    old = rcu_replace_pointer(m720_program, prog,
+                              lockdep_is_held(&m720_config_lock));
+    m720_keybit_update();
+    bitmap_copy(keybit, m720_keybit, KEY_CNT);
+    mutex_unlock(&m720_config_lock);
+
+    m720_output_refresh(keybit);
+
+    if (old)
+        kfree_rcu(old, rcu);
+    return 0;
+}
+
+static int m720_program_get(char *buffer, const struct kernel_param *kp)
+{
+    struct m720_program *prog;
+    int len;
+
+    rcu_read_lock();
+    prog = rcu_dereference(m720_program);
+    len = scnprintf(buffer, PAGE_SIZE, "%s\n", prog ? prog->spec : "");
+    rcu_read_unlock();
+    return len;
+}
+
+static const struct kernel_param_ops m720_program_ops = {
+    .set = m720_program_set,
+    .get = m720_program_get,
+};
+
+module_param_cb(program, &m720_program_ops, NULL, 0644);
+MODULE_PARM_DESC(program, "Mapping program run on every button event before the keymap (empty=none)");
+#else
+/*
+ * The keymap was compiled by gen_profile.py; only the virtual keyboard's
+ * key set is left to fill in.
+ */
+static void m720_fixed_profile_load(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(m720_fixed_keys); i++)
+        __set_bit(m720_fixed_keys[i], m720_keybit);
+}
+#endif
+
+/*
+ * Device match rules, e.g. "vendor=046d,product=b015,keys=side+extra".
+ * Rules are separated by ';' and tried in order; the first one whose
+ * fields all match decides, and a leading '!' makes it exclude.
+ */
+static int m720_parse_bus(const char *val, u16 *bustype)
+{
+    if (!strcasecmp(val, "usb"))
+        *bustype = BUS_USB;
+    else if (!strcasecmp(val, "bluetooth"))
+        *bustype = BUS_BLUETOOTH;
+    else if (!strcasecmp(val, "virtual"))
+        *bustype = BUS_VIRTUAL;
+    else
+        return kstrtou16(val, 16, bustype);
+    return 0;
+}
+
+static int m720_compile_rule(struct m720_rule *rule, char *text)
+{
+    char *field, *val, *key;
+    int code, error = 0;
+
+    if (*text == '!') {
+        rule->exclude = true;
+        text++;
+    }
+
+    while (!error && (field = strsep(&text, ",")) != NULL) {
+        field = strim(field);
+        if (!*field)
+            continue;
+
+        val = strchr(field, '=');
+        if (!val)
+            return -EINVAL;
+        *val++ = '\0';
+        val = strim(val);
+        field = strim(field);
+
+        if (!strcmp(field, "bus")) {
+            rule->fields |= M720_RULE_BUS;
+            error = m720_parse_bus(val, &rule->bustype);
+        } else if (!strcmp(field, "vendor")) {
+            rule->fields |= M720_RULE_VENDOR;
+            error = kstrtou16(val, 16, &rule->vendor);
+        } else if (!strcmp(field, "product")) {
+            rule->fields |= M720_RULE_PRODUCT;
+            error = kstrtou16(val, 16, &rule->product);
+        } else if (!strcmp(field, "name")) {
+            rule->fields |= M720_RULE_NAME;
+            if (strscpy(rule->name, val, sizeof(rule->name)) < 0)
+                error = -E2BIG;
+        } else if (!strcmp(field, "keys")) {
+            rule->fields |= M720_RULE_KEYS;
+            while ((key = strsep(&val, "+")) != NULL) {
+                code = m720_lookup_name(m720_button_names,
+                                        ARRAY_SIZE(m720_button_names), key);
+                if (code < 0)
+                    code = m720_parse_key(key);
+                if (code < 0)
+                    return code;
+                __set_bit(code, rule->keybit);
+            }
+        } else {
+            return -EINVAL;
+        }
+    }
+
+    return error;
+}
+
+static struct m720_rules *m720_compile_rules(const char *spec)
+{
+    struct m720_rules *rules;
+    char *buf, *cur, *text;
+    int error = 0;
+
+    if (strlen(spec) >= M720_RULES_SPEC_LEN)
+        return ERR_PTR(-E2BIG);
+
+    rules = kzalloc(sizeof(*rules), GFP_KERNEL);
+    buf = kstrdup(spec, GFP_KERNEL);
+    if (!rules || !buf) {
+        error = -ENOMEM;
+        goto out;
+    }
+
+    cur = strim(buf);
+    strscpy(rules->spec, cur, sizeof(rules->spec));
+
+    while ((text = strsep(&cur, ";")) != NULL) {
+        text = strim(text);
+        if (!*text)
+            continue;
+
+        if (rules->count == M720_MAX_RULES) {
+            error = -E2BIG;
+            break;
+        }
+
+        error = m720_compile_rule(&rules->rule[rules->count++], text);
+        if (error)
+            break;
+    }
+
+out:
+    kfree(buf);
+    if (error) {
+        kfree(rules);
+        return ERR_PTR(error);
+    }
+    return rules;
+}
+
+/*
+ * Minimal glob for rule names: '*' matches any run, '?' one character
+ */
+static bool m720_glob(const char *pat, const char *str)
+{
+    const char *star = NULL, *back = NULL;
+
+    while (*str) {
+        if (*pat == '*') {
+            star = ++pat;
+            back = str;
+        } else if (*pat == '?' || *pat == *str) {
+            pat++;
+            str++;
+        } else if (star) {
+            pat = star;
+            str = ++back;
+        } else {
+            return false;
+        }
+    }
+
+    while (*pat == '*')
+        pat++;
+    return !*pat;
+}
+
+/*
+ * Run a device through the compiled rules. Ids and keys are plain
+ * compares; a name is only globbed by rules that ask for one.
+ */
+static bool m720_rules_match(struct input_dev *dev)
+{
+    const struct m720_rules *rules;
+    const struct m720_rule *rule;
+    bool match = false;
+    unsigned int i;
+
+    rcu_read_lock();
+    rules = rcu_dereference(m720_rules);
+    for (i = 0; rules && i < rules->count; i++) {
+        rule = &rules->rule[i];
+
+        if ((rule->fields & M720_RULE_BUS) &&
+            dev->id.bustype != rule->bustype)
+            continue;
+        if ((rule->fields & M720_RULE_VENDOR) &&
+            dev->id.vendor != rule->vendor)
+            continue;
+        if ((rule->fields & M720_RULE_PRODUCT) &&
+            dev->id.product != rule->product)
+            continue;
+        if ((rule->fields & M720_RULE_KEYS) &&
+            !bitmap_subset(rule->keybit, dev->keybit, KEY_CNT))
+            continue;
+        if ((rule->fields & M720_RULE_NAME) &&
+            !m720_glob(rule->name, dev->name ?: ""))
+            continue;
+
+        match = !rule->exclude;
+        m720_debug("%s: rule %u %s\n", dev->name ?: "Unknown", i,
+                   match ? "matches" : "excludes");
+        break;
+    }
+    rcu_read_unlock();
+
+    return match;
+}
+
+/*
+ * New rules apply to devices that connect afterwards
+ */
+static int m720_rules_set(const char *val, const struct kernel_param *kp)
+{
+    struct m720_rules *rules, *old;
+
+    rules = m720_compile_rules(val);
+    if (IS_ERR(rules))
+        return PTR_ERR(rules);
+
+    mutex_lock(&m720_config_lock);
+    old = rcu_replace_pointer(m720_rules, rules,
+                              lockdep_is_held(&m720_config_lock));
+    mutex_unlock(&m720_config_lock);
+
+    if (old)
+        kfree_rcu(old, rcu);
+    return 0;
+}
+
+static int m720_rules_get(char *buffer, const struct kernel_param *kp)
+{
+    struct m720_rules *rules;
+    int len;
+
+    rcu_read_lock();
+    rules = rcu_dereference(m720_rules);
+    len = scnprintf(buffer, PAGE_SIZE, "%s\n", rules ? rules->spec : "");
+    rcu_read_unlock();
+    return len;
+}
+
+static const struct kernel_param_ops m720_rules_ops = {
+    .set = m720_rules_set,
+    .get = m720_rules_get,
+};
+
+module_param_cb(match_rules, &m720_rules_ops, NULL, 0644);
+MODULE_PARM_DESC(match_rules, "Devices to bind, e.g. \"vendor=046d,product=b015,keys=side+extra;!name=*Receiver*\"");
+
+static void m720_config_free(void)
+{
+#ifndef M720_FIXED_PROFILE
+    unsigned int i;
+
+    for (i = 0; i < M720_MAX_PROFILES; i++)
+        kfree(rcu_dereference_protected(m720_profiles[i], 1));
+    kfree(rcu_dereference_protected(m720_program, 1));
+    kfree(rcu_dereference_protected(m720_config, 1));
+#endif
+    kfree(rcu_dereference_protected(m720_rules, 1));
+}
+
+/*
+ * Whether the remap_* switches leave a button to the keymap
+ */
+static bool m720_remap_enabled(const struct m720_config *cfg,
+                               unsigned int code)
+{
+    switch (code) {
+    case BTN_SIDE:
+    case BTN_EXTRA:
+        return cfg->remap_side;
+    case BTN_FORWARD:
+    case BTN_BACK:
+        return cfg->remap_extra;
+    }
+    return true;
+}
+
+/*
+ * Find the macro bound to a button in a layer, falling through to the
+ * base layer where the layer leaves the button unmapped, and honouring
+ * the remap_* switches. Must be called under rcu_read_lock().
+ */
+static const struct m720_macro *m720_lookup_macro(const struct m720_config *cfg,
+                                                  unsigned int layer,
+                                                  unsigned int base,
+                                                  unsigned int code)
+{
+    const struct m720_macro *macro;
+
+    if (code < BTN_MOUSE || code >= BTN_MOUSE + M720_NUM_BUTTONS ||
+        !m720_remap_enabled(cfg, code))
+        return NULL;
+
+#ifdef M720_FIXED_PROFILE
+    macro = &m720_fixed_actions[code - BTN_MOUSE];
+#else
+    {
+        struct m720_keymap *keymap = rcu_dereference(m720_profiles[layer]);
+
+        macro = keymap ? &keymap->action[code - BTN_MOUSE] : NULL;
+        if ((!macro || !macro->len) && layer != base)
+            return m720_lookup_macro(cfg, base, base, code);
+        if (!macro)
+            return NULL;
+    }
+#endif
+    return macro->len ? macro : NULL;
+}
+
+/*
+ * The wheel action of a layer for a direction, with the same
+ * fallthrough. Must be called under rcu_read_lock().
+ */
+static const struct m720_macro *m720_lookup_wheel(unsigned int layer,
+                                                  unsigned int base,
+                                                  unsigned int dir)
+{
+    const struct m720_macro *macro;
+
+#ifdef M720_FIXED_PROFILE
+    macro = &m720_fixed_wheel[dir];
+#else
+    struct m720_keymap *keymap = rcu_dereference(m720_profiles[layer]);
+
+    macro = keymap ? &keymap->wheel[dir] : NULL;
+    if ((!macro || !macro->len) && layer != base)
+        return m720_lookup_wheel(base, base, dir);
+    if (!macro)
+        return NULL;
+#endif
+    return macro->len ? macro : NULL;
+}
+
+/*
+ * The gesture button of a layer, else of its base, 0 if neither has
+ * one or the remap_* switches leave it alone. Must be called under
+ * rcu_read_lock().
+ */
+static unsigned int m720_gesture_button(const struct m720_config *cfg,
+                                        unsigned int layer,
+                                        unsigned int base)
+{
+    unsigned int button;
+
+#ifdef M720_FIXED_PROFILE
+    button = M720_FIXED_GESTURE_BUTTON;
+#else
+    struct m720_keymap *keymap = rcu_dereference(m720_profiles[layer]);
+
+    button = keymap ? keymap->gesture_button : 0;
+    if (!button && layer != base)
+        return m720_gesture_button(cfg, base, base);
+#endif
+    return button && m720_remap_enabled(cfg, button) ? button : 0;
+}
+
+#ifndef M720_FIXED_PROFILE
+/*
+ * The chord of a button with exactly mods held, in a layer or else its
+ * base. Must be called under rcu_read_lock().
+ */
+static const struct m720_macro *m720_lookup_chord(unsigned int layer,
+                                                  unsigned int base,
+                                                  unsigned int code, u8 mods)
+{
+    struct m720_keymap *keymap = rcu_dereference(m720_profiles[layer]);
+    unsigned int button = code - BTN_MOUSE, i;
+
+    if (keymap && (keymap->chord_buttons & BIT(button))) {
+        for (i = 0; i < keymap->chords; i++) {
+            if (keymap->chord[i].button == button &&
+                keymap->chord[i].mods == mods)
+                return &keymap->chord[i].macro;
+        }
+    }
+    return layer != base ? m720_lookup_chord(base, base, code, mods) : NULL;
+}
+#endif
+
+/*
+ * The swipe action of a layer for a direction, with the same
+ * fallthrough as buttons. Must be called under rcu_read_lock().
+ */
+static const struct m720_macro *m720_lookup_gesture(unsigned int layer,
+                                                    unsigned int base,
+                                                    unsigned int dir)
+{
+    const struct m720_macro *macro;
+
+#ifdef M720_FIXED_PROFILE
+    macro = &m720_fixed_gestures[dir];
+#else
+    struct m720_keymap *keymap = rcu_dereference(m720_profiles[layer]);
+
+    macro = keymap ? &keymap->gesture[dir] : NULL;
+    if ((!macro || !macro->len) && layer != base)
+        return m720_lookup_gesture(base, base, dir);
+    if (!macro)
+        return NULL;
+#endif
+    return macro->len ? macro : NULL;
+}
+
+/*
+ * Log2 histogram of times: bucket i counts times in [2^(i-1), 2^i) us,
+ * bucket 0 those under 1 us, the last one everything above.
+ */
+static void m720_hist_record(u32 *hist, unsigned int buckets, s64 us)
+{
+    unsigned int bucket = us > 0 ? fls64(us) : 0;
+
+    hist[min_t(unsigned int, bucket, buckets - 1)]++;
+}
+
+/*
+ * A modifier the user already holds on a tracked keyboard is neither
+ * pressed nor released by a macro: pressing it again is redundant, and
+ * releasing it would cancel the physical hold. Only what the macro
+ * pressed itself is released.
+ */
+static bool m720_macro_skip(struct m720_macro_runner *runner,
+                            unsigned int code, bool press)
+{
+    unsigned int i = m720_mod_index(code);
+
+    if (i == M720_MOD_KEYS)
+        return false;
+
+    if (!press) {
+        if (!(runner->skipped & BIT(i)))
+            return false;
+        runner->skipped &= ~BIT(i);
+        return true;
+    }
+
+    if (!(m720_mods() & BIT(i % 4)))
+        return false;
+    runner->skipped |= BIT(i);
+    return true;
+}
+
+/*
+ * Run queued macro steps until the queue drains or a delay is reached.
+ * Called with runner->lock and rcu_read_lock() held, from the filter or
+ * the hrtimer. Mice on one seat share its output, so each run holds
+ * the output's lock and a frame is closed before a delay lets another
+ * runner in: frames of two mice never merge, and the timestamp set for
+ * a frame is the one it goes out with. Until the seat's keyboard is
+ * registered, or while a companion is being replaced, the queue is
+ * held; m720_output_kick() starts it once there is one.
+ */
+static void m720_macro_run(struct m720_macro_runner *runner)
+{
+    struct m720_output *output = runner->output;
+    const struct m720_macro *macro;
+    const struct m720_step *step;
+
+    if (!rcu_access_pointer(output->dev) &&
+        !rcu_access_pointer(output->companion))
+        return;
+
+    spin_lock(&output->lock);
+    while (runner->count) {
+        macro = &runner->queue[runner->head];
+
+        if (!runner->pos) {
+            /* Frames never go back in time behind a queued macro */
+            if (ktime_after(runner->stamp[runner->head], runner->clock))
+                runner->clock = runner->stamp[runner->head];
+            clear_bit(runner->source[runner->head], &runner->pending);
+            m720_hist_record(runner->latency, M720_LATENCY_BUCKETS,
+                             ktime_us_delta(ktime_get(),
+                                            runner->queued_at[runner->head]));
+        }
+
+        while (runner->pos < macro->len) {
+            step = &macro->steps[runner->pos++];
+
+            switch (step->op) {
+            case M720_STEP_PRESS:
+            case M720_STEP_RELEASE:
+                if (m720_macro_skip(runner, step->arg,
+                                    step->op == M720_STEP_PRESS))
+                    break;
+                m720_emit(output, EV_KEY, step->arg,
+                          step->op == M720_STEP_PRESS);
+                runner->dirty = true;
+                break;
+            case M720_STEP_SYNC:
+                /* Nothing to sync if every key was skipped */
+                if (!runner->dirty)
+                    break;
+                m720_emit_sync(runner);
+                runner->dirty = false;
+                break;
+            case M720_STEP_DELAY:
+                if (runner->dirty) {
+                    m720_emit_sync(runner);
+                    runner->dirty = false;
+                }
+                spin_unlock(&output->lock);
+                runner->clock = ktime_add_ms(runner->clock, step->arg);
+                runner->waiting = true;
+                hrtimer_start(&runner->timer, ms_to_ktime(step->arg),
+                              HRTIMER_MODE_REL);
+                return;
+            }
+        }
+
+        runner->head = (runner->head + 1) % M720_MACRO_QUEUE_LEN;
+        runner->count--;
+        runner->pos = 0;
+    }
+    spin_unlock(&output->lock);
+}
+
+static enum hrtimer_restart m720_macro_timer(struct hrtimer *timer)
+{
+    struct m720_macro_runner *runner =
+        container_of(timer, struct m720_macro_runner, timer);
+    unsigned long flags;
+
+    rcu_read_lock();
+    spin_lock_irqsave(&runner->lock, flags);
+    runner->waiting = false;
+    m720_macro_run(runner);
+    spin_unlock_irqrestore(&runner->lock, flags);
+    rcu_read_unlock();
+
+    return HRTIMER_NORESTART;
+}
+
+static void m720_macro_init(struct m720_macro_runner *runner)
+{
+    spin_lock_init(&runner->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&runner->timer, m720_macro_timer, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&runner->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    runner->timer.function = m720_macro_timer;
+#endif
+}
+
+/*
+ * Queue a macro on a device and start it if the device is idle.
+ * Safe in atomic context: copies into the preallocated ring only.
+ * A press whose action is still waiting in the queue is coalesced
+ * into it instead of queueing a duplicate. stamp and msc are the
+ * source frame's time and its MSC_TIMESTAMP value. Only a full queue
+ * drops a macro.
+ */
+static enum m720_verdict m720_macro_queue(struct m720_macro_runner *runner,
+                                          const struct m720_macro *macro,
+                                          unsigned int button, ktime_t stamp,
+                                          u32 msc)
+{
+    unsigned long flags;
+    u8 tail;
+
+    if (test_bit(button, &runner->pending)) {
+        runner->coalesced++;
+        m720_debug("Coalesced button %u with pending macro\n", button);
+        return M720_VERDICT_COALESCED;
+    }
+
+    spin_lock_irqsave(&runner->lock, flags);
+
+    if (runner->count == M720_MACRO_QUEUE_LEN) {
+        runner->dropped++;
+        spin_unlock_irqrestore(&runner->lock, flags);
+        m720_debug("Macro queue full, dropping macro\n");
+        return M720_VERDICT_DROPPED;
+    }
+
+    tail = (runner->head + runner->count) % M720_MACRO_QUEUE_LEN;
+    memcpy(&runner->queue[tail], macro, sizeof(*macro));
+    runner->source[tail] = button;
+    runner->queued_at[tail] = ktime_get();
+    runner->stamp[tail] = stamp;
+    runner->msc[tail] = msc;
+    set_bit(button, &runner->pending);
+    runner->count++;
+
+    if (!runner->waiting)
+        m720_macro_run(runner);
+
+    spin_unlock_irqrestore(&runner->lock, flags);
+    return M720_VERDICT_QUEUED;
+}
+
+/*
+ * Run a device's held macros, unless a delay is pending: its timer
+ * carries on from there. A runner cancelled on disconnect has none.
+ */
+static void m720_macro_resume(struct m720_macro_runner *runner)
+{
+    unsigned long flags;
+
+    rcu_read_lock();
+    spin_lock_irqsave(&runner->lock, flags);
+    if (runner->count && !runner->waiting)
+        m720_macro_run(runner);
+    spin_unlock_irqrestore(&runner->lock, flags);
+    rcu_read_unlock();
+}
+
+/*
+ * Stop a device's macros, releasing any keys the current one still holds
+ */
+static void m720_macro_cancel(struct m720_macro_runner *runner)
+{
+    const struct m720_macro *macro;
+    unsigned long flags;
+    u8 i;
+
+    hrtimer_cancel(&runner->timer);
+
+    spin_lock_irqsave(&runner->lock, flags);
+    rcu_read_lock();
+    if (runner->count && runner->pos) {
+        macro = &runner->queue[runner->head];
+        spin_lock(&runner->output->lock);
+        for (i = runner->pos; i < macro->len; i++) {
+            if (macro->steps[i].op == M720_STEP_RELEASE &&
+                !m720_macro_skip(runner, macro->steps[i].arg, false)) {
+                m720_emit(runner->output, EV_KEY, macro->steps[i].arg, 0);
+                runner->dirty = true;
+            }
+        }
+        if (runner->dirty)
+            m720_emit_sync(runner);
+        spin_unlock(&runner->output->lock);
+    }
+    rcu_read_unlock();
+    runner->count = 0;
+    runner->pos = 0;
+    runner->skipped = 0;
+    runner->dirty = false;
+    runner->pending = 0;
+    runner->waiting = false;
+    spin_unlock_irqrestore(&runner->lock, flags);
+}
+
+/*
+ * Kinetic wheel. Velocity is tracked in Q8 hi-res units per tick as an
+ * exponential average of the input rate; a flick starts from rest, so a
+ * lone notch moves exactly one notch and never coasts.
+ */
+static void m720_kinetic_track(struct m720_kinetic *kin, int value,
+                               ktime_t now)
+{
+    s64 gap = ktime_us_delta(now, kin->last);
+    s32 rate;
+
+    if (gap > M720_KINETIC_GAP_MS * USEC_PER_MSEC ||
+        (value ^ kin->velocity) < 0) {
+        kin->velocity = 0;
+        kin->residue = 0;
+        return;
+    }
+
+    rate = div_s64((s64)value * (M720_KINETIC_TICK_MS * USEC_PER_MSEC) <<
+                   M720_KINETIC_SHIFT, max_t(s64, gap, 1));
+    kin->velocity += (rate - kin->velocity) / 4;
+    kin->velocity = clamp_t(s32, kin->velocity,
+                            -(M720_KINETIC_MAX_SPEED << M720_KINETIC_SHIFT),
+                            M720_KINETIC_MAX_SPEED << M720_KINETIC_SHIFT);
+}
+
+/*
+ * Units to emit on one tick: the motion that arrived since the last
+ * tick while the wheel turns, the decaying velocity once it stops.
+ * Called with kin->lock held.
+ */
+static s32 m720_kinetic_step(struct m720_kinetic *kin,
+                             const struct m720_config *cfg)
+{
+    s32 out, keep;
+
+    if (kin->pending) {
+        out = kin->pending;
+        kin->pending = 0;
+        return out;
+    }
+
+    if (!cfg->kinetic_scroll)
+        kin->velocity = 0;
+    if (!kin->velocity)
+        return 0;
+
+    /* Friction as a Q10 multiplier */
+    keep = ((1000 - cfg->scroll_friction) << 10) / 1000;
+    kin->velocity = ((s64)kin->velocity * keep) >> 10;
+    if (abs(kin->velocity) < (1 << M720_KINETIC_SHIFT)) {
+        kin->velocity = 0;
+        kin->residue = 0;
+        return 0;
+    }
+
+    kin->residue += kin->velocity;
+    out = kin->residue >> M720_KINETIC_SHIFT;
+    kin->residue -= out * (1 << M720_KINETIC_SHIFT);
+    return out;
+}
+
+/*
+ * Frames the kinetic and pointer timers re-inject into the mouse pass
+ * our own filter: injecting_cpu marks the CPU doing it, and inject_lock
+ * keeps the two timers from overwriting each other's mark.
+ */
+static void m720_inject_begin(struct m720_device *m720_dev,
+                              unsigned long *flags)
+{
+    spin_lock_irqsave(&m720_dev->inject_lock, *flags);
+    WRITE_ONCE(m720_dev->injecting_cpu, smp_processor_id());
+}
+
+static void m720_inject_end(struct m720_device *m720_dev,
+                            unsigned long flags)
+{
+    WRITE_ONCE(m720_dev->injecting_cpu, -1);
+    spin_unlock_irqrestore(&m720_dev->inject_lock, flags);
+}
+
+static enum hrtimer_restart m720_kinetic_timer(struct hrtimer *timer)
+{
+    struct m720_kinetic *kin = container_of(timer, struct m720_kinetic, timer);
+    struct m720_device *m720_dev;
+    struct input_handle *handle;
+    unsigned long flags;
+    s32 out, detents;
+    bool restart;
+
+    rcu_read_lock();
+    spin_lock_irqsave(&kin->lock, flags);
+    out = m720_kinetic_step(kin, m720_config_snapshot());
+    kin->detents += out;
+    detents = kin->detents / M720_WHEEL_DETENT;
+    kin->detents -= detents * M720_WHEEL_DETENT;
+    restart = out || kin->velocity;
+    kin->running = restart;
+    handle = kin->handle;
+    spin_unlock_irqrestore(&kin->lock, flags);
+    rcu_read_unlock();
+
+    if (out && handle) {
+        m720_dev = container_of(kin, struct m720_device, kinetic);
+        m720_inject_begin(m720_dev, &flags);
+        input_inject_event(handle, EV_REL, REL_WHEEL_HI_RES, out);
+        if (detents)
+            input_inject_event(handle, EV_REL, REL_WHEEL, detents);
+        input_inject_event(handle, EV_SYN, SYN_REPORT, 0);
+        m720_inject_end(m720_dev, flags);
+    }
+
+    if (!restart)
+        return HRTIMER_NORESTART;
+    hrtimer_forward_now(timer, ms_to_ktime(M720_KINETIC_TICK_MS));
+    return HRTIMER_RESTART;
+}
+
+static void m720_kinetic_init(struct m720_kinetic *kin)
+{
+    spin_lock_init(&kin->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&kin->timer, m720_kinetic_timer, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&kin->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    kin->timer.function = m720_kinetic_timer;
+#endif
+}
+
+/*
+ * Take a wheel event off a mouse with a hi-res wheel, kinetic_scroll
+ * being on for its report. The low-res axis is consumed too: the timer
+ * derives it from the hi-res stream.
+ */
+static enum m720_verdict m720_kinetic_input(struct m720_kinetic *kin,
+                                            struct input_handle *handle,
+                                            unsigned int code, int value)
+{
+    unsigned long flags;
+    ktime_t now;
+
+    if (!test_bit(REL_WHEEL_HI_RES, handle->dev->relbit))
+        return M720_VERDICT_PASS;
+    if (code == REL_WHEEL)
+        return M720_VERDICT_CONSUMED;
+
+    now = m720_frame_time(handle->dev);
+
+    spin_lock_irqsave(&kin->lock, flags);
+    m720_kinetic_track(kin, value, now);
+    kin->last = now;
+    kin->pending += value;
+    kin->handle = handle;
+    if (!kin->running) {
+        kin->running = true;
+        hrtimer_start(&kin->timer, 0, HRTIMER_MODE_REL);
+    }
+    spin_unlock_irqrestore(&kin->lock, flags);
+
+    return M720_VERDICT_CONSUMED;
+}
+
+/*
+ * A click stops a coasting wheel, as a touch stops a flick
+ */
+static void m720_kinetic_brake(struct m720_kinetic *kin)
+{
+    unsigned long flags;
+
+    if (!READ_ONCE(kin->velocity))
+        return;
+
+    spin_lock_irqsave(&kin->lock, flags);
+    kin->velocity = 0;
+    kin->residue = 0;
+    spin_unlock_irqrestore(&kin->lock, flags);
+}
+
+/*
+ * Stop injecting through a link that is going away
+ */
+static void m720_kinetic_cancel(struct m720_kinetic *kin,
+                                struct input_handle *handle)
+{
+    unsigned long flags;
+
+    if (READ_ONCE(kin->handle) != handle)
+        return;
+
+    hrtimer_cancel(&kin->timer);
+
+    spin_lock_irqsave(&kin->lock, flags);
+    kin->handle = NULL;
+    kin->running = false;
+    kin->pending = 0;
+    kin->velocity = 0;
+    kin->residue = 0;
+    kin->detents = 0;
+    spin_unlock_irqrestore(&kin->lock, flags);
+}
+
+/*
+ * Pointer transform, see m720_transform.h. Motion cannot be rewritten in
+ * place or re-injected from the filter (the mouse's event_lock is held),
+ * so each report's transformed motion goes out from an hrtimer armed to
+ * fire at once.
+ */
+static enum hrtimer_restart m720_pointer_timer(struct hrtimer *timer)
+{
+    struct m720_pointer *ptr = container_of(timer, struct m720_pointer, timer);
+    struct m720_device *m720_dev;
+    struct input_handle *handle;
+    unsigned long flags;
+    s32 dx, dy;
+
+    spin_lock_irqsave(&ptr->lock, flags);
+    dx = ptr->out_x;
+    dy = ptr->out_y;
+    ptr->out_x = 0;
+    ptr->out_y = 0;
+    ptr->queued = false;
+    handle = ptr->handle;
+    spin_unlock_irqrestore(&ptr->lock, flags);
+
+    if ((dx || dy) && handle) {
+        m720_dev = container_of(ptr, struct m720_device, pointer);
+        m720_inject_begin(m720_dev, &flags);
+        if (dx)
+            input_inject_event(handle, EV_REL, REL_X, dx);
+        if (dy)
+            input_inject_event(handle, EV_REL, REL_Y, dy);
+        input_inject_event(handle, EV_SYN, SYN_REPORT, 0);
+        m720_inject_end(m720_dev, flags);
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+static void m720_pointer_init(struct m720_pointer *ptr)
+{
+    spin_lock_init(&ptr->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&ptr->timer, m720_pointer_timer, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&ptr->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ptr->timer.function = m720_pointer_timer;
+#endif
+}
+
+/*
+ * Collect one axis of a report, pointer_transform being on for it.
+ * Filter calls for the active link are serialized, so the raw counts
+ * need no lock.
+ */
+static enum m720_verdict m720_pointer_input(struct m720_pointer *ptr,
+                                            unsigned int code, int value)
+{
+    if (code == REL_X)
+        ptr->raw_x += value;
+    else
+        ptr->raw_y += value;
+    return M720_VERDICT_CONSUMED;
+}
+
+/*
+ * End of a report: transform what was collected and hand it to the timer
+ */
+static void m720_pointer_frame(struct m720_pointer *ptr,
+                               const struct m720_config *cfg,
+                               struct input_handle *handle)
+{
+    ktime_t now = m720_frame_time(handle->dev);
+    s32 dx = ptr->raw_x, dy = ptr->raw_y;
+    unsigned long flags;
+
+    if (!dx && !dy)
+        return;
+    ptr->raw_x = 0;
+    ptr->raw_y = 0;
+
+    m720_xform_apply(&cfg->xform, &ptr->state, &dx, &dy,
+                     min_t(s64, ktime_us_delta(now, ptr->last), U32_MAX));
+    ptr->last = now;
+    if (!dx && !dy)
+        return;
+
+    spin_lock_irqsave(&ptr->lock, flags);
+    ptr->out_x += dx;
+    ptr->out_y += dy;
+    ptr->handle = handle;
+    if (!ptr->queued) {
+        ptr->queued = true;
+        hrtimer_start(&ptr->timer, 0, HRTIMER_MODE_REL);
+    }
+    spin_unlock_irqrestore(&ptr->lock, flags);
+}
+
+/*
+ * Stop injecting through a link that is going away
+ */
+static void m720_pointer_cancel(struct m720_pointer *ptr,
+                                struct input_handle *handle)
+{
+    unsigned long flags;
+
+    if (READ_ONCE(ptr->handle) != handle)
+        return;
+
+    hrtimer_cancel(&ptr->timer);
+
+    spin_lock_irqsave(&ptr->lock, flags);
+    ptr->handle = NULL;
+    ptr->queued = false;
+    ptr->out_x = 0;
+    ptr->out_y = 0;
+    spin_unlock_irqrestore(&ptr->lock, flags);
+}
+
+/*
+ * Debounce filter for worn switches. An edge that repeats the accepted
+ * state, or a press within debounce_ms of the last accepted edge, is a
+ * bounce. A release is always taken, even inside the window, so a tap
+ * shorter than the window still ends: the input core has already seen
+ * it, and a swallowed release could never be delivered later. It
+ * restarts the window, which then swallows the chatter behind it.
+ * Keeps the held-button bitmap in step with accepted edges. Returns
+ * true if the edge should be swallowed.
+ */
+static bool m720_debounce(struct m720_device *m720_dev,
+                          const struct m720_config *cfg, unsigned int button,
+                          int value)
+{
+    unsigned int window = cfg->debounce_ms[button];
+    bool pressed = value != 0;
+    ktime_t now;
+
+    if (value == 2)
+        return false;
+
+    if (window) {
+        if (pressed == test_bit(button, &m720_dev->buttons))
+            goto bounce;
+
+        now = ktime_get();
+        if (pressed &&
+            ktime_to_ns(ktime_sub(now, m720_dev->last_edge[button])) <
+            (s64)window * NSEC_PER_MSEC)
+            goto bounce;
+
+        m720_dev->last_edge[button] = now;
+    }
+
+    if (pressed)
+        __set_bit(button, &m720_dev->buttons);
+    else
+        __clear_bit(button, &m720_dev->buttons);
+    return false;
+
+bounce:
+    m720_dev->bounces++;
+    m720_debug("Debounced button %u edge %d\n", button, value);
+    return true;
+}
+
+/*
+ * Token bucket per device and button, kept in GCRA form: a single
+ * theoretical arrival time replaces the token count and refill timer.
+ * Filter calls for one device are serialized by the input core, so
+ * this needs no locks or atomics.
+ */
+static bool m720_rate_allow(struct m720_device *m720_dev,
+                            const struct m720_config *cfg, unsigned int button)
+{
+    unsigned int rate = cfg->rate_limit;
+    unsigned int burst = cfg->rate_burst;
+    u64 now, tat, interval;
+
+    if (!rate)
+        return true;
+
+    interval = NSEC_PER_SEC / rate;
+    now = ktime_get_ns();
+    tat = max(m720_dev->rate_tat[button], now);
+
+    if (tat - now > interval * (max(burst, 1u) - 1))
+        return false;
+
+    m720_dev->rate_tat[button] = tat + interval;
+    return true;
+}
+
+/*
+ * MSC_TIMESTAMP value for a source frame: the mouse's own hardware
+ * clock extrapolated from the last value it reported, else the frame
+ * time itself.
+ */
+static u32 m720_msc_value(struct m720_device *m720_dev, ktime_t stamp)
+{
+    if (m720_dev->msc_at)
+        return m720_dev->msc_base +
+               (u32)ktime_us_delta(stamp, m720_dev->msc_at);
+    return (u32)ktime_to_us(stamp);
+}
+
+/*
+ * Fire the macro of an action source (a button, a wheel direction after
+ * the buttons, or a program's output for a button after those), subject
+ * to the rate limit. A program and the keymap can both fire on one
+ * edge; the edge is charged once, to its button, and both share the
+ * outcome. Must be called under rcu_read_lock().
+ */
+static enum m720_verdict m720_fire(struct m720_device *m720_dev,
+                                   const struct m720_config *cfg,
+                                   struct input_handle *handle,
+                                   const struct m720_macro *macro,
+                                   unsigned int source)
+{
+    unsigned int bucket = source < M720_NUM_SOURCES ? source :
+                                                      source - M720_NUM_SOURCES;
+    ktime_t stamp;
+
+    m720_debug("Source %u fired - running %d step macro\n",
+               source, macro->len);
+
+    if (m720_dev->rate_edge != m720_dev->events) {
+        m720_dev->rate_edge = m720_dev->events;
+        m720_dev->rate_ok = m720_rate_allow(m720_dev, cfg, bucket);
+        if (!m720_dev->rate_ok)
+            m720_dev->limited++;
+    }
+    if (!m720_dev->rate_ok) {
+        m720_debug("Source %u over rate limit, dropped\n", source);
+        return M720_VERDICT_LIMITED;
+    }
+
+    m720_dev->remapped++;
+    stamp = m720_frame_time(handle->dev);
+    return m720_macro_queue(&m720_dev->runner, macro, source,
+                            stamp, msc_timestamp ?
+                            m720_msc_value(m720_dev, stamp) : 0);
+}
+
+/*
+ * The layer lookups start from: the highest layer switched on, else
+ * the base layer (the device's profile)
+ */
+static unsigned int m720_active_layer(struct m720_device *m720_dev)
+{
+    return m720_dev->layers ? __fls(m720_dev->layers) :
+                              READ_ONCE(m720_dev->profile);
+}
+
+/*
+ * Layer keys: LAYER holds its layer on while pressed, TOGGLE flips it
+ * on each press. Filter calls are serialized, so the stack needs no lock.
+ */
+static enum m720_verdict m720_layer_key(struct m720_device *m720_dev,
+                                        const struct m720_step *step,
+                                        int value)
+{
+    if (step->op == M720_STEP_LAYER && value != 2) {
+        if (value)
+            __set_bit(step->arg, &m720_dev->layers);
+        else
+            __clear_bit(step->arg, &m720_dev->layers);
+    } else if (step->op == M720_STEP_TOGGLE && value == 1) {
+        __change_bit(step->arg, &m720_dev->layers);
+    }
+
+    m720_debug("Layers now %#lx\n", m720_dev->layers);
+    return M720_VERDICT_CONSUMED;
+}
+
+#ifndef M720_FIXED_PROFILE
+/*
+ * Interpret a verified program for one event. Keys it emits collect in
+ * out, to be queued as one macro. The verifier bounds the loop below;
+ * overflowing out aborts the program with nothing emitted.
+ */
+static enum m720_prog_exit m720_prog_run(const struct m720_program *prog,
+                                         const struct m720_config *cfg,
+                                         struct m720_device *m720_dev,
+                                         const s32 *ctx,
+                                         struct m720_macro *out)
+{
+    u8 loop_pc[M720_PROG_MAX_DEPTH], loop_left[M720_PROG_MAX_DEPTH];
+    s32 reg[M720_PROG_REGS] = { 0 };
+    const struct m720_macro *macro;
+    const struct m720_insn *insn;
+    unsigned int pc = 0, depth = 0;
+    int error = 0;
+    s32 src;
+
+    out->len = 0;
+    while (pc < prog->len) {
+        insn = &prog->insn[pc++];
+        src = insn->src == M720_PROG_IMM ? insn->imm : reg[insn->src];
+
+        switch (insn->op) {
+        case M720_OP_MOV:
+            reg[insn->dst] = src;
+            break;
+        case M720_OP_ADD:
+            reg[insn->dst] = (u32)reg[insn->dst] + (u32)src;
+            break;
+        case M720_OP_SUB:
+            reg[insn->dst] = (u32)reg[insn->dst] - (u32)src;
+            break;
+        case M720_OP_AND:
+            reg[insn->dst] &= src;
+            break;
+        case M720_OP_OR:
+            reg[insn->dst] |= src;
+            break;
+        case M720_OP_XOR:
+            reg[insn->dst] ^= src;
+            break;
+        case M720_OP_LD:
+            reg[insn->dst] = ctx[insn->aux];
+            break;
+        case M720_OP_LDM:
+            reg[insn->dst] = m720_dev->scratch[insn->aux];
+            break;
+        case M720_OP_STM:
+            m720_dev->scratch[insn->aux] = src;
+            break;
+        case M720_OP_JA:
+            pc = insn->aux;
+            break;
+        case M720_OP_JEQ:
+            if (reg[insn->dst] == src)
+                pc = insn->aux;
+            break;
+        case M720_OP_JNE:
+            if (reg[insn->dst] != src)
+                pc = insn->aux;
+            break;
+        case M720_OP_JGT:
+            if (reg[insn->dst] > src)
+                pc = insn->aux;
+            break;
+        case M720_OP_JLT:
+            if (reg[insn->dst] < src)
+                pc = insn->aux;
+            break;
+        case M720_OP_JSET:
+            if (reg[insn->dst] & src)
+                pc = insn->aux;
+            break;
+        case M720_OP_REPEAT:
+            loop_pc[depth] = pc;
+            loop_left[depth++] = insn->imm;
+            break;
+        case M720_OP_END:
+            if (--loop_left[depth - 1])
+                pc = loop_pc[depth - 1];
+            else
+                depth--;
+            break;
+        case M720_OP_PRESS:
+            error = m720_add_step(out, M720_STEP_PRESS, insn->imm);
+            break;
+        case M720_OP_RELEASE:
+            error = m720_add_step(out, M720_STEP_RELEASE, insn->imm);
+            break;
+        case M720_OP_TAP:
+            error = m720_add_step(out, M720_STEP_PRESS, insn->imm) ?:
+                    m720_add_step(out, M720_STEP_SYNC, 0) ?:
+                    m720_add_step(out, M720_STEP_DELAY, M720_CHORD_HOLD_MS) ?:
+                    m720_add_step(out, M720_STEP_RELEASE, insn->imm) ?:
+                    m720_add_step(out, M720_STEP_SYNC, 0);
+            break;
+        case M720_OP_SYNC:
+            error = m720_add_step(out, M720_STEP_SYNC, 0);
+            break;
+        case M720_OP_DELAY:
+            error = m720_add_step(out, M720_STEP_DELAY, insn->imm);
+            break;
+        case M720_OP_RUN:
+            macro = m720_lookup_macro(cfg, ctx[M720_CTX_LAYER],
+                                      ctx[M720_CTX_PROFILE], insn->imm);
+            if (!macro || macro->steps[0].op >= M720_STEP_LAYER)
+                break;
+            if (out->len + macro->len > M720_MACRO_MAX_STEPS) {
+                error = -E2BIG;
+                break;
+            }
+            memcpy(&out->steps[out->len], macro->steps,
+                   macro->len * sizeof(*macro->steps));
+            out->len += macro->len;
+            break;
+        case M720_OP_EXIT:
+            return insn->imm;
+        }
+
+        if (unlikely(error)) {
+            m720_debug("Program emitted over %d steps, aborted\n",
+                       M720_MACRO_MAX_STEPS);
+            out->len = 0;
+            return M720_PROG_NEXT;
+        }
+    }
+    return M720_PROG_NEXT;
+}
+
+/*
+ * Run the loaded program, if any, on a button event and queue what it
+ * emits. *next tells the caller to go on to the keymap. Must be called
+ * under rcu_read_lock().
+ */
+static enum m720_verdict m720_prog_event(struct m720_device *m720_dev,
+                                         const struct m720_config *cfg,
+                                         struct input_handle *handle,
+                                         unsigned int code, int value,
+                                         bool *next)
+{
+    const struct m720_program *prog = rcu_dereference(m720_program);
+    enum m720_prog_exit exit;
+    enum m720_verdict verdict;
+    s32 ctx[M720_CTX_FIELDS];
+    struct m720_macro out;
+
+    *next = true;
+    if (!prog)
+        return M720_VERDICT_PASS;
+
+    /* A new program starts from clear scratch slots */
+    if (m720_dev->prog_gen != prog->gen) {
+        memset(m720_dev->scratch, 0, sizeof(m720_dev->scratch));
+        m720_dev->prog_gen = prog->gen;
+    }
+
+    ctx[M720_CTX_CODE] = code;
+    ctx[M720_CTX_VALUE] = value;
+    ctx[M720_CTX_BUTTONS] = m720_dev->buttons;
+    ctx[M720_CTX_LAYER] = m720_active_layer(m720_dev);
+    ctx[M720_CTX_PROFILE] = READ_ONCE(m720_dev->profile);
+    ctx[M720_CTX_MODS] = m720_mods();
+
+    exit = m720_prog_run(prog, cfg, m720_dev, ctx, &out);
+
+    /* Whatever was emitted ends on a frame boundary */
+    if (out.len && out.steps[out.len - 1].op != M720_STEP_SYNC &&
+        m720_add_step(&out, M720_STEP_SYNC, 0))
+        out.len = 0;
+
+    verdict = exit == M720_PROG_PASS ? M720_VERDICT_PASS :
+                                       M720_VERDICT_CONSUMED;
+    if (out.len) {
+        enum m720_verdict fired;
+
+        fired = m720_fire(m720_dev, cfg, handle, &out,
+                          M720_PROG_SOURCE(code - BTN_MOUSE));
+
+        if (exit == M720_PROG_DROP)
+            verdict = fired;
+    }
+
+    *next = exit == M720_PROG_NEXT;
+    return verdict;
+}
+
+/*
+ * Chords with keyboard modifiers are decided on press; a button that
+ * fired one is consumed until it is released, whatever the modifiers do
+ * meanwhile. PASS leaves the event to the keymap. Must be called under
+ * rcu_read_lock().
+ */
+static enum m720_verdict m720_chord(struct m720_device *m720_dev,
+                                   const struct m720_config *cfg,
+                                   struct input_handle *handle,
+                                   unsigned int layer, unsigned int base,
+                                   unsigned int code, int value)
+{
+    unsigned int button = code - BTN_MOUSE;
+    const struct m720_macro *macro;
+    u8 mods;
+
+    if (value != 1) {
+        if (!test_bit(button, &m720_dev->chorded))
+            return M720_VERDICT_PASS;
+        if (!value)
+            __clear_bit(button, &m720_dev->chorded);
+        return M720_VERDICT_CONSUMED;
+    }
+
+    mods = m720_mods();
+    if (!mods)
+        return M720_VERDICT_PASS;
+
+    macro = m720_lookup_chord(layer, base, code, mods);
+    if (!macro)
+        return M720_VERDICT_PASS;
+
+    m720_debug("Button %u chorded with modifiers %#x\n", button, mods);
+    __set_bit(button, &m720_dev->chorded);
+    return m720_fire(m720_dev, cfg, handle, macro, button);
+}
+#endif
+
+/*
+ * Wheel notches and tilts mapped in the active layer fire their action
+ * per REL_WHEEL/REL_HWHEEL event; the matching hi-res events are only
+ * swallowed. Unmapped directions pass. Must be called under
+ * rcu_read_lock().
+ */
+static enum m720_verdict m720_wheel(struct m720_device *m720_dev,
+                                    const struct m720_config *cfg,
+                                    struct input_handle *handle,
+                                    unsigned int code, int value)
+{
+    const struct m720_macro *macro;
+    unsigned int dir;
+
+    if (code == REL_WHEEL || code == REL_WHEEL_HI_RES)
+        dir = value > 0 ? M720_WHEEL_UP : M720_WHEEL_DOWN;
+    else
+        dir = value > 0 ? M720_WHEEL_RIGHT : M720_WHEEL_LEFT;
+
+    macro = m720_lookup_wheel(m720_active_layer(m720_dev),
+                              READ_ONCE(m720_dev->profile), dir);
+    if (!macro)
+        return M720_VERDICT_PASS;
+    if (code == REL_WHEEL_HI_RES || code == REL_HWHEEL_HI_RES ||
+        macro->steps[0].op >= M720_STEP_LAYER)
+        return M720_VERDICT_CONSUMED;
+
+    return m720_fire(m720_dev, cfg, handle, macro, M720_NUM_BUTTONS + dir);
+}
+
+/*
+ * Gesture button: while it is held, pointer motion is collected instead
+ * of moving the pointer. On release, travel past gesture_threshold
+ * fires the action for its main direction; less is a tap and fires the
+ * button's own action. Both are looked up in the layer the button went
+ * down in. Must be called under rcu_read_lock().
+ */
+static enum m720_verdict m720_gesture_key(struct m720_device *m720_dev,
+                                          const struct m720_config *cfg,
+                                          struct input_handle *handle,
+                                          unsigned int layer,
+                                          unsigned int profile,
+                                          unsigned int code, int value)
+{
+    struct m720_gesture *gesture = &m720_dev->gesture;
+    const struct m720_macro *macro;
+    s32 ax, ay;
+    int dir;
+
+    if (value == 1) {
+        gesture->button = code - BTN_MOUSE;
+        gesture->x = 0;
+        gesture->y = 0;
+        return M720_VERDICT_CONSUMED;
+    }
+
+    /* A release whose press was not taken as a gesture is not ours */
+    if (value != 0 || gesture->button != code - BTN_MOUSE)
+        return value ? M720_VERDICT_CONSUMED : M720_VERDICT_PASS;
+    gesture->button = M720_GESTURE_NONE;
+
+    ax = abs(gesture->x);
+    ay = abs(gesture->y);
+    if ((u32)max(ax, ay) < cfg->gesture_threshold)
+        dir = -1;
+    else if (ax >= ay)
+        dir = gesture->x < 0 ? M720_GESTURE_LEFT : M720_GESTURE_RIGHT;
+    else
+        dir = gesture->y < 0 ? M720_GESTURE_UP : M720_GESTURE_DOWN;
+
+    m720_debug("Gesture %d (%d,%d) on button %d\n",
+               dir, gesture->x, gesture->y, code);
+
+    macro = dir < 0 ? m720_lookup_macro(cfg, layer, profile, code) :
+                      m720_lookup_gesture(layer, profile, dir);
+    if (!macro || macro->steps[0].op >= M720_STEP_LAYER)
+        return M720_VERDICT_CONSUMED;
+    return m720_fire(m720_dev, cfg, handle, macro, code - BTN_MOUSE);
+}
+
+/*
+ * Settings that tie the events of a report together are read once, at
+ * its first event, and hold until its SYN_REPORT: a change landing
+ * between REL_X and REL_Y, or between the hi-res and low-res wheel,
+ * applies to the whole of the next report instead of half of this one.
+ */
+static u8 m720_frame(struct m720_device *m720_dev)
+{
+    const struct m720_config *cfg;
+
+    if (likely(m720_dev->frame & M720_FRAME_OPEN))
+        return m720_dev->frame;
+
+    rcu_read_lock();
+    cfg = m720_config_snapshot();
+    m720_dev->frame = M720_FRAME_OPEN |
+                      (cfg->pointer_transform ? M720_FRAME_POINTER : 0) |
+                      (cfg->kinetic_scroll ? M720_FRAME_KINETIC : 0);
+    rcu_read_unlock();
+    return m720_dev->frame;
+}
+
+/*
+ * Events from a standby transport are left alone, except buttons with
+ * something bound: passed on raw, a press would reach userspace as the
+ * bare button and its release later be consumed as a mapped one. Those
+ * are withheld until the transport settles.
+ */
+static enum m720_verdict m720_standby(struct m720_device *m720_dev,
+                                      unsigned int type, unsigned int code)
+{
+    const struct m720_config *cfg;
+    unsigned int profile, layer;
+    bool mapped;
+
+    if (type != EV_KEY || code < BTN_MOUSE ||
+        code >= BTN_MOUSE + M720_NUM_BUTTONS)
+        return M720_VERDICT_STANDBY;
+
+    profile = READ_ONCE(m720_dev->profile);
+    layer = m720_active_layer(m720_dev);
+
+    rcu_read_lock();
+    cfg = m720_config_snapshot();
+    mapped = m720_lookup_macro(cfg, layer, profile, code) ||
+             code == m720_gesture_button(cfg, layer, profile);
+#ifndef M720_FIXED_PROFILE
+    mapped = mapped || rcu_access_pointer(m720_program) ||
+             m720_lookup_chord(layer, profile, code, m720_mods());
+#endif
+    rcu_read_unlock();
+
+    return mapped ? M720_VERDICT_WITHHELD : M720_VERDICT_STANDBY;
+}
+
+/*
+ * Decide what happens to one event: pass it on, or consume it and
+ * possibly fire the button's macro.
+ */
+static enum m720_verdict m720_decide(struct m720_device *m720_dev,
+                                     struct input_handle *handle,
+                                     unsigned int type, unsigned int code,
+                                     int value)
+{
+    const struct m720_config *cfg;
+    const struct m720_macro *macro;
+    enum m720_verdict verdict;
+    unsigned int profile, layer;
+
+    if (!READ_ONCE(m720_dev->enabled))
+        return M720_VERDICT_DISABLED;
+
+    /* Frames from a standby transport of the same mouse are not ours */
+    if (unlikely(READ_ONCE(m720_dev->active) != handle) &&
+        !m720_claim_transport(m720_dev, handle))
+        return m720_standby(m720_dev, type, code);
+    if (m720_dev->last_frame != jiffies)
+        WRITE_ONCE(m720_dev->last_frame, jiffies);
+
+    m720_dev->events++;
+
+    if (type == EV_MSC && code == MSC_TIMESTAMP && msc_timestamp) {
+        m720_dev->msc_base = value;
+        m720_dev->msc_at = m720_frame_time(handle->dev);
+        return M720_VERDICT_PASS;
+    }
+
+    if (type == EV_REL && (code == REL_X || code == REL_Y)) {
+        /* Motion is the gesture's while its button is held */
+        if (unlikely(m720_dev->gesture.button != M720_GESTURE_NONE)) {
+            if (code == REL_X)
+                m720_dev->gesture.x += value;
+            else
+                m720_dev->gesture.y += value;
+            return M720_VERDICT_CONSUMED;
+        }
+
+        if (!(m720_frame(m720_dev) & M720_FRAME_POINTER))
+            return M720_VERDICT_PASS;
+        return m720_pointer_input(&m720_dev->pointer, code, value);
+    }
+
+    if (type == EV_SYN && code == SYN_REPORT) {
+        rcu_read_lock();
+        m720_pointer_frame(&m720_dev->pointer, m720_config_snapshot(),
+                           handle);
+        rcu_read_unlock();
+        m720_dev->frame = 0;
+        return M720_VERDICT_PASS;
+    }
+
+    if (type == EV_REL &&
+        (code == REL_WHEEL || code == REL_HWHEEL ||
+         code == REL_WHEEL_HI_RES || code == REL_HWHEEL_HI_RES)) {
+        rcu_read_lock();
+        cfg = m720_config_snapshot();
+        verdict = value ? m720_wheel(m720_dev, cfg, handle, code, value) :
+                          M720_VERDICT_PASS;
+        if (verdict == M720_VERDICT_PASS &&
+            (code == REL_WHEEL || code == REL_WHEEL_HI_RES) &&
+            (m720_frame(m720_dev) & M720_FRAME_KINETIC))
+            verdict = m720_kinetic_input(&m720_dev->kinetic, handle,
+                                         code, value);
+        rcu_read_unlock();
+        return verdict;
+    }
+
+    if (type != EV_KEY)
+        return M720_VERDICT_PASS;
+
+    if (value == 1)
+        m720_kinetic_brake(&m720_dev->kinetic);
+
+    /* One config snapshot for the whole decision */
+    rcu_read_lock();
+    cfg = m720_config_snapshot();
+
+    /* Bounces are dropped before they can reach dispatch */
+    if (code >= BTN_MOUSE && code < BTN_MOUSE + M720_NUM_BUTTONS &&
+        m720_debounce(m720_dev, cfg, code - BTN_MOUSE, value)) {
+        rcu_read_unlock();
+        return M720_VERDICT_BOUNCE;
+    }
+
+#ifndef M720_FIXED_PROFILE
+    if (code >= BTN_MOUSE && code < BTN_MOUSE + M720_NUM_BUTTONS) {
+        bool next;
+
+        verdict = m720_prog_event(m720_dev, cfg, handle, code, value, &next);
+        if (!next) {
+            rcu_read_unlock();
+            return verdict;
+        }
+    }
+#endif
+
+    /*
+     * A button acts in the layer that was active when it went down, so
+     * its release still lands on the same entry after a layer change
+     */
+    profile = READ_ONCE(m720_dev->profile);
+    if (code >= BTN_MOUSE && code < BTN_MOUSE + M720_NUM_BUTTONS) {
+        if (value == 1)
+            m720_dev->key_layer[code - BTN_MOUSE] =
+                m720_active_layer(m720_dev);
+        layer = m720_dev->key_layer[code - BTN_MOUSE];
+    } else {
+        layer = profile;
+    }
+
+    if (code == m720_gesture_button(cfg, layer, profile) ||
+        (m720_dev->gesture.button != M720_GESTURE_NONE &&
+         code - BTN_MOUSE == m720_dev->gesture.button)) {
+        verdict = m720_gesture_key(m720_dev, cfg, handle, layer, profile,
+                                   code, value);
+        rcu_read_unlock();
+        return verdict;
+    }
+
+#ifndef M720_FIXED_PROFILE
+    if (code >= BTN_MOUSE && code < BTN_MOUSE + M720_NUM_BUTTONS) {
+        verdict = m720_chord(m720_dev, cfg, handle, layer, profile, code,
+                             value);
+        if (verdict != M720_VERDICT_PASS) {
+            rcu_read_unlock();
+            return verdict;
+        }
+    }
+#endif
+
+    macro = m720_lookup_macro(cfg, layer, profile, code);
+    verdict = macro ? M720_VERDICT_CONSUMED : M720_VERDICT_PASS;
+    if (macro && macro->steps[0].op >= M720_STEP_LAYER)
+        verdict = m720_layer_key(m720_dev, &macro->steps[0], value);
+    else if (macro && value == 1)
+        verdict = m720_fire(m720_dev, cfg, handle, macro, code - BTN_MOUSE);
+    rcu_read_unlock();
+
+    /* Press, release and repeat of a mapped button are all consumed */
+    return verdict;
+}
+
+#ifndef M720_FIXED_PROFILE
+/*
+ * Flight recorder: keep the last M720_RECORD_LEN non-motion events and
+ * what was decided for each, always on. Pointer motion is left out as
+ * it would flush the button history within milliseconds. Links of one
+ * device can record concurrently, hence the atomic slot claim; a reader
+ * may catch a slot mid-write, which is fine for a diagnostic.
+ */
+static void m720_record(struct m720_device *m720_dev, struct input_dev *dev,
+                        unsigned int type, unsigned int code, int value,
+                        enum m720_verdict verdict)
+{
+    struct m720_record *rec;
+
+    if (type == EV_REL || type == EV_SYN)
+        return;
+
+    rec = &m720_dev->records[(atomic_inc_return(&m720_dev->record_head) - 1) &
+                             (M720_RECORD_LEN - 1)];
+    rec->time = ktime_to_ns(m720_frame_time(dev));
+    rec->value = value;
+    rec->code = code;
+    rec->type = type;
+    rec->verdict = verdict;
+}
+
+/*
+ * Report-interval profiler: per link, a log2 histogram of the time
+ * between frames and an RFC 3550 style running jitter estimate over
+ * consecutive intervals within a burst of reports. Each link's stats
+ * are only written by its own handle.
+ */
+static void m720_profile_frame(struct m720_link_stats *stats,
+                               struct input_dev *dev)
+{
+    ktime_t now = m720_frame_time(dev);
+    u32 interval, delta;
+
+    if (stats->frames++) {
+        interval = min_t(s64, ktime_us_delta(now, stats->last), U32_MAX);
+        m720_hist_record(stats->intervals, M720_INTERVAL_BUCKETS, interval);
+
+        if (interval < M720_BURST_GAP_US && stats->prev < M720_BURST_GAP_US) {
+            delta = interval > stats->prev ? interval - stats->prev :
+                                             stats->prev - interval;
+            stats->jitter16 += delta - stats->jitter16 / 16;
+        }
+        stats->prev = interval;
+    }
+    stats->last = now;
+}
+
+/*
+ * Start a link's profile afresh when a transport takes its slot
+ */
+static void m720_profile_reset(struct m720_link_stats *stats, u16 bustype)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->bustype = bustype;
+    stats->prev = M720_BURST_GAP_US;
+}
+#endif
+
+/*
+ * Filter function - swallows mapped buttons and fires their macros
+ */
+static bool m720_filter(struct input_handle *handle, unsigned int type,
+                       unsigned int code, int value)
+{
+    struct m720_device *m720_dev = handle->private;
+    enum m720_verdict verdict;
+
+    /* Frames re-injected by the kinetic or pointer timer on this CPU */
+    if (unlikely(READ_ONCE(m720_dev->injecting_cpu) ==
+                 raw_smp_processor_id()))
+        return false;
+
+#ifdef M720_FIXED_PROFILE
+    verdict = m720_decide(m720_dev, handle, type, code, value);
+#else
+    if (type == EV_SYN && code == SYN_REPORT)
+        m720_profile_frame(&m720_dev->link_stats[handle - m720_dev->handles],
+                           handle->dev);
+
+    verdict = m720_decide(m720_dev, handle, type, code, value);
+    m720_record(m720_dev, handle->dev, type, code, value, verdict);
+#endif
+
+    return verdict >= M720_VERDICT_BOUNCE;
+}
+
+/*
+ * Per-device sysfs interface: /sys/class/m720/<phys>/
+ */
+static ssize_t enabled_show(struct device *dev, struct device_attribute *attr,
+                            char *buf)
+{
+    struct m720_device *m720_dev = dev_get_drvdata(dev);
+
+    return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(m720_dev->enabled));
+}
+
+static ssize_t enabled_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    struct m720_device *m720_dev = dev_get_drvdata(dev);
+    bool enabled;
+    int error;
+
+    error = kstrtobool(buf, &enabled);
+    if (error)
+        return error;
+
+    WRITE_ONCE(m720_dev->enabled, enabled);
+    return count;
+}
+static DEVICE_ATTR_RW(enabled);
+
+static ssize_t profile_show(struct device *dev, struct device_attribute *attr,
+                            char *buf)
+{
+    struct m720_device *m720_dev = dev_get_drvdata(dev);
+
+    return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(m720_dev->profile));
+}
+
+static ssize_t profile_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    struct m720_device *m720_dev = dev_get_drvdata(dev);
+    u8 profile;
+    int error;
+
+    error = kstrtou8(buf, 10, &profile);
+    if (error)
+        return error;
+    if (profile >= M720_MAX_PROFILES)
+        return -EINVAL;
+
+    WRITE_ONCE(m720_dev->profile, profile);
+    return count;
+}
+static DEVICE_ATTR_RW(profile);
+
+static ssize_t layer_show(struct device *dev, struct device_attribute *attr,
+                          char *buf)
+{
+    struct m720_device *m720_dev = dev_get_drvdata(dev);
+    unsigned long layers = READ_ONCE(m720_dev->layers);
+
+    /* Active layer, then the bitmask of layers switched on */
+    return scnprintf(buf, PAGE_SIZE, "%u %#lx\n",
+                     layers ? (unsigned int)__fls(layers) :
+                              READ_ONCE(m720_dev->profile), layers);
+}
+static DEVICE_ATTR_RO(layer);
+
+static ssize_t latency_histogram_show(struct device *dev,
+                                      struct device_attribute *attr, char *buf)
+{
+    struct m720_device *m720_dev = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    unsigned int i;
+
+    /* One "<lower bound in us> <count>" line per bucket */
+    for (i = 0; i < M720_LATENCY_BUCKETS; i++)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%u %u\n",
+                         i ? 1u << (i - 1) : 0,
+                         READ_ONCE(m720_dev->runner.latency[i]));
+    return len;
+}
+static DEVICE_ATTR_RO(latency_histogram);
+
+static struct attribute *m720_dev_attrs[] = {
+    &dev_attr_enabled.attr,
+    &dev_attr_profile.attr,
+    &dev_attr_layer.attr,
+    &dev_attr_latency_histogram.attr,
+    NULL,
+};
+
+static const struct attribute_group m720_dev_group = {
+    .attrs = m720_dev_attrs,
+};
+
+#define M720_STAT_ATTR(_name, _field)                                   \
+static ssize_t _name##_show(struct device *dev,                         \
+                            struct device_attribute *attr, char *buf)   \
+{                                                                       \
+    struct m720_device *m720_dev = dev_get_drvdata(dev);                \
+                                                                        \
+    return scnprintf(buf, PAGE_SIZE, "%llu\n",                          \
+                     (unsigned long long)READ_ONCE(m720_dev->_field));  \
+}                                                                       \
+static DEVICE_ATTR_RO(_name)
+
+M720_STAT_ATTR(events, events);
+M720_STAT_ATTR(remapped, remapped);
+M720_STAT_ATTR(bounces, bounces);
+M720_STAT_ATTR(rate_limited, limited);
+M720_STAT_ATTR(coalesced, runner.coalesced);
+M720_STAT_ATTR(dropped, runner.dropped);
+
+static struct attribute *m720_stat_attrs[] = {
+    &dev_attr_events.attr,
+    &dev_attr_remapped.attr,
+    &dev_attr_bounces.attr,
+    &dev_attr_rate_limited.attr,
+    &dev_attr_coalesced.attr,
+    &dev_attr_dropped.attr,
+    NULL,
+};
+
+static const struct attribute_group m720_stat_group = {
+    .name = "statistics",
+    .attrs = m720_stat_attrs,
+};
+
+static const struct attribute_group *m720_dev_groups[] = {
+    &m720_dev_group,
+    &m720_stat_group,
+    NULL,
+};
+
+static struct class m720_class = {
+    .name = "m720",
+    .dev_groups = m720_dev_groups,
+};
+
+#ifndef M720_FIXED_PROFILE
+/*
+ * Copy a device's flight recorder out oldest first. Returns the number
+ * of records copied into recs, which must hold M720_RECORD_LEN.
+ */
+static unsigned int m720_records_snapshot(struct m720_device *m720_dev,
+                                          struct m720_record *recs)
+{
+    unsigned int head = atomic_read(&m720_dev->record_head);
+    unsigned int count = min_t(unsigned int, head, M720_RECORD_LEN);
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+        recs[i] = m720_dev->records[(head - count + i) &
+                                    (M720_RECORD_LEN - 1)];
+    return count;
+}
+
+static const char * const m720_verdict_names[] = {
+    [M720_VERDICT_PASS]      = "pass",
+    [M720_VERDICT_DISABLED]  = "disabled",
+    [M720_VERDICT_STANDBY]   = "standby",
+    [M720_VERDICT_BOUNCE]    = "bounce",
+    [M720_VERDICT_CONSUMED]  = "consumed",
+    [M720_VERDICT_QUEUED]    = "queued",
+    [M720_VERDICT_COALESCED] = "coalesced",
+    [M720_VERDICT_DROPPED]   = "dropped",
+    [M720_VERDICT_LIMITED]   = "limited",
+    [M720_VERDICT_WITHHELD]  = "withheld",
+};
+
+static int m720_frames_show(struct seq_file *m, void *unused)
+{
+    struct m720_record *recs;
+    unsigned int i, count;
+    u64 secs;
+    u32 nsecs;
+
+    recs = kmalloc_array(M720_RECORD_LEN, sizeof(*recs), GFP_KERNEL);
+    if (!recs)
+        return -ENOMEM;
+
+    count = m720_records_snapshot(m->private, recs);
+    for (i = 0; i < count; i++) {
+        secs = div_u64_rem(recs[i].time, NSEC_PER_SEC, &nsecs);
+        seq_printf(m, "%5llu.%06lu %02x %03x %d %s\n", secs,
+                   nsecs / NSEC_PER_USEC, recs[i].type, recs[i].code,
+                   recs[i].value,
+                   recs[i].verdict < ARRAY_SIZE(m720_verdict_names) ?
+                   m720_verdict_names[recs[i].verdict] : "?");
+    }
+
+    kfree(recs);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(m720_frames);
+
+/* Binary view: the records as struct m720_record, oldest first */
+static int m720_frames_bin_open(struct inode *inode, struct file *file)
+{
+    struct m720_frames *frames;
+
+    frames = kmalloc(sizeof(*frames), GFP_KERNEL);
+    if (!frames)
+        return -ENOMEM;
+
+    frames->count = m720_records_snapshot(inode->i_private, frames->recs);
+    file->private_data = frames;
+    return 0;
+}
+
+static ssize_t m720_frames_bin_read(struct file *file, char __user *buf,
+                                    size_t len, loff_t *ppos)
+{
+    struct m720_frames *frames = file->private_data;
+
+    return simple_read_from_buffer(buf, len, ppos, frames->recs,
+                                   frames->count * sizeof(frames->recs[0]));
+}
+
+static int m720_frames_bin_release(struct inode *inode, struct file *file)
+{
+    kfree(file->private_data);
+    return 0;
+}
+
+static const struct file_operations m720_frames_bin_fops = {
+    .owner   = THIS_MODULE,
+    .open    = m720_frames_bin_open,
+    .read    = m720_frames_bin_read,
+    .release = m720_frames_bin_release,
+    .llseek  = default_llseek,
+};
+
+static const char *m720_bus_name(u16 bustype)
+{
+    switch (bustype) {
+    case BUS_USB:
+        return "usb";
+    case BUS_BLUETOOTH:
+        return "bluetooth";
+    default:
+        return "other";
+    }
+}
+
+/*
+ * Report intervals per link: a summary line, then one
+ * "<lower bound in us> <count>" line per bucket
+ */
+static int m720_intervals_show(struct seq_file *m, void *unused)
+{
+    struct m720_device *m720_dev = m->private;
+    const struct m720_link_stats *stats;
+    unsigned int i, slot;
+
+    for (slot = 0; slot < M720_MAX_LINKS; slot++) {
+        stats = &m720_dev->link_stats[slot];
+        if (!READ_ONCE(stats->frames))
+            continue;
+
+        seq_printf(m, "link %u %s (0x%02x) %s: %llu frames, jitter %u us\n",
+                   slot, m720_bus_name(stats->bustype), stats->bustype,
+                   test_bit(slot, &m720_dev->links) ? "up" : "down",
+                   READ_ONCE(stats->frames),
+                   READ_ONCE(stats->jitter16) / 16);
+        for (i = 0; i < M720_INTERVAL_BUCKETS; i++)
+            seq_printf(m, "%u %u\n", i ? 1u << (i - 1) : 0,
+                       READ_ONCE(stats->intervals[i]));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(m720_intervals);
+
+/*
+ * Per-device debugfs directory, named like the sysfs one
+ */
+static void m720_debugfs_add(struct m720_device *m720_dev, const char *name)
+{
+    m720_dev->debugfs = debugfs_create_dir(name, m720_debugfs_root);
+    debugfs_create_file("frames", 0400, m720_dev->debugfs, m720_dev,
+                        &m720_frames_fops);
+    debugfs_create_file("frames.bin", 0400, m720_dev->debugfs, m720_dev,
+                        &m720_frames_bin_fops);
+    debugfs_create_file("intervals", 0400, m720_dev->debugfs, m720_dev,
+                        &m720_intervals_fops);
+}
+#endif
+
+/*
+ * Create the device's sysfs directory, named after its phys path (the
+ * driver core turns '/' into '!') or the input device name if the phys
+ * is missing or taken. It has no parent so it outlives the input device
+ * while parked. Failure only costs the sysfs interface.
+ */
+static void m720_sysfs_add(struct m720_device *m720_dev, struct input_dev *dev)
+{
+    struct device *sysfs_dev = ERR_PTR(-ENODEV);
+
+    if (dev->phys && *dev->phys)
+        sysfs_dev = device_create(&m720_class, NULL, 0, m720_dev,
+                                  "%s", dev->phys);
+    if (IS_ERR(sysfs_dev))
+        sysfs_dev = device_create(&m720_class, NULL, 0, m720_dev,
+                                  "%s", dev_name(&dev->dev));
+    if (IS_ERR(sysfs_dev)) {
+        printk(KERN_WARNING MODULE_NAME ": No sysfs directory for %s: %ld\n",
+               m720_dev->name, PTR_ERR(sysfs_dev));
+#ifndef M720_FIXED_PROFILE
+        m720_debugfs_add(m720_dev, dev_name(&dev->dev));
+#endif
+        return;
+    }
+
+    m720_dev->sysfs_dev = sysfs_dev;
+#ifndef M720_FIXED_PROFILE
+    m720_debugfs_add(m720_dev, dev_name(sysfs_dev));
+#endif
+}
+
+static void m720_sysfs_remove(struct m720_device *m720_dev)
+{
+#ifndef M720_FIXED_PROFILE
+    debugfs_remove_recursive(m720_dev->debugfs);
+    m720_dev->debugfs = NULL;
+#endif
+
+    if (m720_dev->sysfs_dev) {
+        device_unregister(m720_dev->sysfs_dev);
+        m720_dev->sysfs_dev = NULL;
+    }
+}
+
+/*
+ * Match function - determines if we should handle this device
+ */
+static bool m720_match(struct input_handler *handler, struct input_dev *dev)
+{
+    return is_m720_device(dev);
+}
+
+/*
+ * Identity aliases: "a=b,c=d" says a and b (and c and d) are the same
+ * physical mouse, e.g. its Unifying serial and its Bluetooth address.
+ */
+static int m720_alias_set(const char *val, const struct kernel_param *kp)
+{
+    struct m720_alias *aliases;
+    char *buf, *cur, *pair, *eq;
+    unsigned int count = 0;
+    int error = 0;
+
+    aliases = kcalloc(M720_MAX_ALIASES, sizeof(*aliases), GFP_KERNEL);
+    buf = kstrdup(val, GFP_KERNEL);
+    if (!aliases || !buf) {
+        error = -ENOMEM;
+        goto out;
+    }
+
+    cur = strim(buf);
+    while ((pair = strsep(&cur, ",")) != NULL) {
+        pair = strim(pair);
+        if (!*pair)
+            continue;
+
+        eq = strchr(pair, '=');
+        if (!eq || count == M720_MAX_ALIASES) {
+            error = eq ? -E2BIG : -EINVAL;
+            break;
+        }
+        *eq++ = '\0';
+
+        strscpy(aliases[count].from, strim(pair), M720_IDENT_LEN);
+        strscpy(aliases[count].to, strim(eq), M720_IDENT_LEN);
+        count++;
+    }
+
+    if (!error) {
+        mutex_lock(&m720_state_lock);
+        memcpy(m720_aliases, aliases, count * sizeof(*aliases));
+        m720_alias_count = count;
+        mutex_unlock(&m720_state_lock);
+    }
+out:
+    kfree(buf);
+    kfree(aliases);
+    return error;
+}
+
+static int m720_alias_get(char *buffer, const struct kernel_param *kp)
+{
+    unsigned int i;
+    int len = 0;
+
+    mutex_lock(&m720_state_lock);
+    for (i = 0; i < m720_alias_count; i++)
+        len += scnprintf(buffer + len, PAGE_SIZE - len, "%s%s=%s",
+                         i ? "," : "", m720_aliases[i].from,
+                         m720_aliases[i].to);
+    mutex_unlock(&m720_state_lock);
+
+    len += scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+    return len;
+}
+
+static const struct kernel_param_ops m720_alias_ops = {
+    .set = m720_alias_set,
+    .get = m720_alias_get,
+};
+
+module_param_cb(identity_alias, &m720_alias_ops, NULL, 0644);
+MODULE_PARM_DESC(identity_alias, "Identities of one physical mouse on different transports, e.g. \"4a7b1c2d=dc:2c:26:11:22:33\"");
+
+/*
+ * Resolve a device's identity: dev->uniq (Bluetooth address or receiver
+ * serial) or, failing that, the phys path, mapped through the aliases.
+ * Must be called with m720_state_lock held.
+ */
+static void m720_identity(struct input_dev *dev, char *ident, size_t len)
+{
+    unsigned int i;
+
+    strscpy(ident, (dev->uniq && *dev->uniq) ? dev->uniq :
+                   (dev->phys ?: ""), len);
+
+    for (i = 0; i < m720_alias_count; i++) {
+        if (!strcmp(ident, m720_aliases[i].to)) {
+            strscpy(ident, m720_aliases[i].from, len);
+            break;
+        }
+    }
+}
+
+/*
+ * Find the connected state for an identity that can take another link.
+ * Must be called with m720_state_lock held.
+ */
+static struct m720_device *m720_find_live(const char *ident)
+{
+    struct m720_device *m720_dev;
+
+    if (!*ident)
+        return NULL;
+
+    list_for_each_entry(m720_dev, &m720_devices, node) {
+        if (!strcmp(m720_dev->ident, ident) &&
+            m720_dev->links != BIT(M720_MAX_LINKS) - 1)
+            return m720_dev;
+    }
+    return NULL;
+}
+
+/*
+ * Reconnect handover: when a mouse disconnects (Bluetooth sleep, an
+ * Easy-Switch channel flip, a re-pair) its state is parked in a small
+ * LRU keyed by its identity instead of being freed, so that a reconnect
+ * resumes with profile, debounce history and statistics intact and no
+ * reinitialisation.
+ */
+static bool m720_can_park(struct m720_device *m720_dev)
+{
+    return READ_ONCE(park_slots) && m720_dev->ident[0];
+}
+
+static void m720_device_free(struct m720_device *m720_dev)
+{
+    m720_sysfs_remove(m720_dev);
+    kmem_cache_free(m720_device_cache, m720_dev);
+}
+
+static void m720_park_expire(struct work_struct *work)
+{
+    struct m720_device *m720_dev, *tmp;
+    unsigned int ms = READ_ONCE(handover_ms);
+    unsigned long timeout = msecs_to_jiffies(ms);
+
+    if (!ms)
+        return;
+
+    mutex_lock(&m720_state_lock);
+    list_for_each_entry_safe(m720_dev, tmp, &m720_parked, node) {
+        if (time_before(jiffies, m720_dev->parked_at + timeout))
+            continue;
+        m720_debug("Parked state for %s expired\n", m720_dev->name);
+        list_del(&m720_dev->node);
+        m720_parked_count--;
+        m720_device_free(m720_dev);
+    }
+
+    /* Oldest first: re-arm for the next state to expire */
+    if (!list_empty(&m720_parked)) {
+        m720_dev = list_first_entry(&m720_parked, struct m720_device,
+                                    node);
+        schedule_delayed_work(&m720_park_work,
+                              m720_dev->parked_at + timeout - jiffies);
+    }
+    mutex_unlock(&m720_state_lock);
+}
+
+/*
+ * Park a state that just lost its last link. Must be called with
+ * m720_state_lock held.
+ */
+static void m720_park(struct m720_device *m720_dev)
+{
+    struct m720_device *oldest;
+    unsigned int ms = READ_ONCE(handover_ms);
+
+    /* Evict the least recently disconnected states to make room */
+    while (!list_empty(&m720_parked) &&
+           m720_parked_count >= READ_ONCE(park_slots)) {
+        oldest = list_first_entry(&m720_parked, struct m720_device,
+                                  node);
+        m720_debug("Evicting parked state for %s\n", oldest->name);
+        list_del(&oldest->node);
+        m720_parked_count--;
+        m720_device_free(oldest);
+    }
+
+    m720_dev->parked_at = jiffies;
+    list_add_tail(&m720_dev->node, &m720_parked);
+    m720_parked_count++;
+    /*
+     * handover_ms may have been set while states were already parked, so
+     * don't rely on this being the first one. A pending expiry is left
+     * alone: it re-arms itself for whatever is still parked.
+     */
+    if (ms)
+        schedule_delayed_work(&m720_park_work, msecs_to_jiffies(ms));
+}
+
+/*
+ * Take a parked state for an identity off the LRU. Must be called with
+ * m720_state_lock held.
+ */
+static struct m720_device *m720_unpark(const char *ident)
+{
+    struct m720_device *m720_dev;
+
+    if (!*ident)
+        return NULL;
+
+    list_for_each_entry(m720_dev, &m720_parked, node) {
+        if (!strcmp(m720_dev->ident, ident)) {
+            list_del(&m720_dev->node);
+            m720_parked_count--;
+            return m720_dev;
+        }
+    }
+    return NULL;
+}
+
+static void m720_park_flush(void)
+{
+    struct m720_device *m720_dev, *tmp;
+
+    cancel_delayed_work_sync(&m720_park_work);
+
+    mutex_lock(&m720_state_lock);
+    list_for_each_entry_safe(m720_dev, tmp, &m720_parked, node) {
+        list_del(&m720_dev->node);
+        m720_device_free(m720_dev);
+    }
+    m720_parked_count = 0;
+    mutex_unlock(&m720_state_lock);
+}
+
+/*
+ * One physical mouse seen on several transports (Unifying and Bluetooth)
+ * shares a single state with one link per transport. Only the active
+ * link is processed; another link takes over once the active one has
+ * been quiet for M720_TRANSPORT_HOLD_MS. Links of one state can deliver
+ * concurrently, hence the cmpxchg.
+ */
+static bool m720_claim_transport(struct m720_device *m720_dev,
+                                 struct input_handle *handle)
+{
+    struct input_handle *active = READ_ONCE(m720_dev->active);
+
+    if (active && time_before(jiffies, READ_ONCE(m720_dev->last_frame) +
+                              msecs_to_jiffies(M720_TRANSPORT_HOLD_MS)))
+        return false;
+
+    if (cmpxchg(&m720_dev->active, active, handle) != active)
+        return false;
+
+    m720_debug("%s: switched to transport %s\n", m720_dev->name,
+               handle->dev->phys ?: "unknown");
+    return true;
+}
+
+/*
+ * Connect to a new M720 device
+ */
+static int m720_connect(struct input_handler *handler, struct input_dev *dev,
+                       const struct input_device_id *id)
+{
+    struct m720_device *m720_dev;
+    struct input_handle *handle;
+    char ident[M720_IDENT_LEN];
+    bool resumed = false, linked = false;
+    unsigned int slot;
+    int error;
+    
+    /* Check if this is actually an M720 device */
+    if (!is_m720_device(dev)) {
+        m720_debug("Device %s is not an M720, skipping\n", 
+                  dev->name ?: "Unknown");
+        return -ENODEV;
+    }
+    
+    /*
+     * Already connected over another transport: add a link. Seen
+     * recently (sleep, channel flip, re-pair): reuse its parked state.
+     */
+    mutex_lock(&m720_state_lock);
+    m720_identity(dev, ident, sizeof(ident));
+    m720_dev = m720_find_live(ident);
+    if (m720_dev)
+        linked = true;
+    else
+        m720_dev = m720_unpark(ident);
+    mutex_unlock(&m720_state_lock);
+    
+    if (linked) {
+        printk(KERN_INFO MODULE_NAME ": Linking transport %s to M720 device: %s\n",
+               dev->phys ?: "unknown", m720_dev->name);
+    } else if (m720_dev) {
+        resumed = true;
+        printk(KERN_INFO MODULE_NAME ": Resuming M720 device: %s\n",
+               dev->name ?: "Unknown");
+        /* The input core released everything when the old device left */
+        m720_dev->buttons = 0;
+        m720_dev->layers = 0;
+        m720_dev->chorded = 0;
+        m720_dev->gesture.button = M720_GESTURE_NONE;
+        /*
+         * Nor is a report from the old device finished. Its timers were
+         * cancelled with its last link, so nothing else touches these.
+         */
+        m720_dev->frame = 0;
+        m720_dev->pointer.raw_x = 0;
+        m720_dev->pointer.raw_y = 0;
+        m720_dev->pointer.last = 0;
+        memset(&m720_dev->pointer.state, 0, sizeof(m720_dev->pointer.state));
+        m720_dev->kinetic.pending = 0;
+        m720_dev->kinetic.velocity = 0;
+        m720_dev->kinetic.residue = 0;
+        m720_dev->kinetic.detents = 0;
+    } else {
+        printk(KERN_INFO MODULE_NAME ": Connecting to M720 device: %s\n", 
+               dev->name ?: "Unknown");
+        print_device_info(dev);
+        
+        /* Allocate memory for our device structure */
+        m720_dev = kmem_cache_zalloc(m720_device_cache, GFP_KERNEL);
+        if (!m720_dev) {
+            printk(KERN_ERR MODULE_NAME ": Failed to allocate device memory\n");
+            return -ENOMEM;
+        }
+        
+        m720_dev->enabled = true;
+        m720_dev->gesture.button = M720_GESTURE_NONE;
+        m720_dev->injecting_cpu = -1;
+        spin_lock_init(&m720_dev->inject_lock);
+        m720_macro_init(&m720_dev->runner);
+        m720_kinetic_init(&m720_dev->kinetic);
+        m720_pointer_init(&m720_dev->pointer);
+        strscpy(m720_dev->ident, ident, sizeof(m720_dev->ident));
+    }
+    
+    if (!linked) {
+        /* Store device info */
+        snprintf(m720_dev->name, sizeof(m720_dev->name), "%s", 
+                 dev->name ?: "M720");
+        snprintf(m720_dev->phys, sizeof(m720_dev->phys), "%s", 
+                 dev->phys ?: "unknown");
+        
+        /* Route this mouse's injected keys to its seat's virtual keyboard */
+        m720_dev->runner.output = m720_output_get(dev);
+        if (!m720_dev->runner.output) {
+            error = -ENOMEM;
+            goto err_free;
+        }
+    }
+    
+    /* Initialize the handle in a free link slot */
+    slot = ffz(m720_dev->links);
+    handle = &m720_dev->handles[slot];
+    memset(handle, 0, sizeof(*handle));
+    handle->dev = dev;
+    handle->handler = handler;
+    handle->name = MODULE_NAME;
+    handle->private = m720_dev;
+    
+    /* Register the handle */
+    error = input_register_handle(handle);
+    if (error) {
+        printk(KERN_ERR MODULE_NAME ": Failed to register handle: %d\n", error);
+        goto err_free;
+    }
+    
+    /* Open the handle */
+    error = input_open_device(handle);
+    if (error) {
+        printk(KERN_ERR MODULE_NAME ": Failed to open device: %d\n", error);
+        input_unregister_handle(handle);
+        goto err_free;
+    }
+    
+#ifndef M720_FIXED_PROFILE
+    m720_profile_reset(&m720_dev->link_stats[slot], dev->id.bustype);
+#endif
+    m720_dev->links |= BIT(slot);
+    if (linked)
+        return 0;
+    
+    WRITE_ONCE(m720_dev->active, handle);
+    if (!resumed)
+        m720_sysfs_add(m720_dev, dev);
+    
+    mutex_lock(&m720_state_lock);
+    list_add_tail(&m720_dev->node, &m720_devices);
+    mutex_unlock(&m720_state_lock);
+    
+    /* The output may have been published before the kick could see us */
+    m720_macro_resume(&m720_dev->runner);
+    
+    device_count++;
+    printk(KERN_INFO MODULE_NAME ": Successfully connected to M720 device (total: %d)\n", 
+           device_count);
+    
+    return 0;
+
+err_free:
+    if (!linked) {
+        m720_output_put(m720_dev->runner.output);
+        m720_device_free(m720_dev);
+    }
+    return error;
+}
+
+/*
+ * Disconnect from M720 device
+ */
+static void m720_disconnect(struct input_handle *handle)
+{
+    struct m720_device *m720_dev = handle->private;
+    
+    printk(KERN_INFO MODULE_NAME ": Disconnecting from M720 device: %s\n",
+           m720_dev ? m720_dev->name : "Unknown");
+    
+    input_close_device(handle);
+    input_unregister_handle(handle);
+    
+    if (!m720_dev)
+        return;
+    
+    /* Filter calls have stopped; the handle is still safe to inject into */
+    m720_kinetic_cancel(&m720_dev->kinetic, handle);
+    m720_pointer_cancel(&m720_dev->pointer, handle);
+    
+    /* Another transport of the same mouse is still connected */
+    m720_dev->links &= ~BIT(handle - m720_dev->handles);
+    if (READ_ONCE(m720_dev->active) == handle)
+        WRITE_ONCE(m720_dev->active, NULL);
+    if (m720_dev->links) {
+        printk(KERN_INFO MODULE_NAME ": Transport %s gone, M720 device still linked\n",
+               handle->dev->phys ?: "unknown");
+        return;
+    }
+    
+    m720_macro_cancel(&m720_dev->runner);
+    m720_output_put(m720_dev->runner.output);
+    m720_dev->runner.output = NULL;
+    m720_debug("%s: %llu events, %llu remapped, %u bounces, "
+               "%u rate limited, %u coalesced, %u macros dropped\n",
+               m720_dev->name, m720_dev->events, m720_dev->remapped,
+               m720_dev->bounces, m720_dev->limited,
+               m720_dev->runner.coalesced, m720_dev->runner.dropped);
+    
+    mutex_lock(&m720_state_lock);
+    list_del(&m720_dev->node);
+    if (m720_can_park(m720_dev)) {
+        m720_debug("Parking %s for reconnect\n", m720_dev->name);
+        m720_park(m720_dev);
+    } else {
+        m720_device_free(m720_dev);
+    }
+    mutex_unlock(&m720_state_lock);
+    device_count--;
+    
+    printk(KERN_INFO MODULE_NAME ": M720 device disconnected (remaining: %d)\n", 
+           device_count);
+}
+
+/* Input handler structure */
+static struct input_handler m720_handler = {
+    .filter     = m720_filter,
+    .match      = m720_match,
+    .connect    = m720_connect,
+    .disconnect = m720_disconnect,
+    .name       = MODULE_NAME,
+    .id_table   = m720_ids,
+};
+
+/* Companion keyboard handler, registered with companion_inject only */
+static struct input_handler m720_companion_handler = {
+    .match      = m720_companion_match,
+    .connect    = m720_companion_connect,
+    .disconnect = m720_companion_disconnect,
+    .name       = MODULE_NAME "_companion",
+    .id_table   = m720_companion_ids,
+};
+
+/* Modifier tracker, registered with track_modifiers only */
+static struct input_handler m720_tracker_handler = {
+    .event      = m720_tracker_event,
+    .match      = m720_tracker_match,
+    .connect    = m720_tracker_connect,
+    .disconnect = m720_tracker_disconnect,
+    .name       = MODULE_NAME "_modifiers",
+    .id_table   = m720_tracker_ids,
+};
+
+/*
+ * Module initialization
+ */
+static int __init m720_remapper_init(void)
+{
+    int error;
+    
+    printk(KERN_INFO MODULE_NAME ": Loading Logitech M720 Button Remapper v%s\n", 
+           M720_VERSION);
+    printk(KERN_INFO MODULE_NAME ": Debug mode: %s\n", 
+           debug_mode ? "enabled" : "disabled");
+#ifdef M720_FIXED_PROFILE
+    printk(KERN_INFO MODULE_NAME ": Fixed profile: %s\n",
+           M720_FIXED_PROFILE_NAME);
+#else
+    printk(KERN_INFO MODULE_NAME ": Side button remapping: %s\n",
+           remap_side_buttons ? "enabled" : "disabled");
+    printk(KERN_INFO MODULE_NAME ": Extra button remapping: %s\n",
+           remap_extra_buttons ? "enabled" : "disabled");
+#endif
+    printk(KERN_INFO MODULE_NAME ": Seat routing: %s\n",
+           seat_routing ? "enabled" : "disabled");
+    printk(KERN_INFO MODULE_NAME ": Companion injection: %s\n",
+           companion_inject ? "enabled" : "disabled");
+    printk(KERN_INFO MODULE_NAME ": Modifier tracking: %s\n",
+           !track_modifiers ? "disabled" :
+           track_modifiers == 1 ? "Logitech keyboards" : "all keyboards");
+    
+#ifdef M720_FIXED_PROFILE
+    m720_fixed_profile_load();
+#else
+    /* Parameters given at load time have published a config already */
+    if (!rcu_access_pointer(m720_config)) {
+        error = m720_config_publish();
+        if (error)
+            goto err_free_keymap;
+    }
+#endif
+    
+    /* Likewise the default match rules */
+    if (!rcu_access_pointer(m720_rules)) {
+        error = m720_rules_set(M720_DEFAULT_RULES, NULL);
+        if (error)
+            goto err_free_keymap;
+    }
+    
+#ifndef M720_FIXED_PROFILE
+    /* Compile the default keymap unless one was given at load time */
+    if (!rcu_access_pointer(m720_profiles[0])) {
+        error = m720_profile_store(0, M720_DEFAULT_KEYMAP);
+        if (error)
+            goto err_free_keymap;
+    }
+#endif
+    
+    /* Per-device state comes from a dedicated, cache-aligned slab */
+    m720_device_cache = KMEM_CACHE(m720_device, SLAB_HWCACHE_ALIGN);
+    if (!m720_device_cache) {
+        printk(KERN_ERR MODULE_NAME ": Failed to create device cache\n");
+        error = -ENOMEM;
+        goto err_free_keymap;
+    }
+    
+    error = class_register(&m720_class);
+    if (error) {
+        printk(KERN_ERR MODULE_NAME ": Failed to register class: %d\n", error);
+        goto err_destroy_cache;
+    }
+    
+#ifndef M720_FIXED_PROFILE
+    /* Flight recorder views; debugfs is optional, errors are ignored */
+    m720_debugfs_root = debugfs_create_dir(MODULE_NAME, NULL);
+#endif
+    
+    /* Companions first, so the first mouse can use one straight away */
+    if (companion_inject) {
+        error = input_register_handler(&m720_companion_handler);
+        if (error) {
+            printk(KERN_ERR MODULE_NAME ": Failed to register companion handler: %d\n", error);
+            goto err_unregister_class;
+        }
+    }
+    
+    /* Keyboards next, so chords work from the first mouse event */
+    if (track_modifiers) {
+        error = input_register_handler(&m720_tracker_handler);
+        if (error) {
+            printk(KERN_ERR MODULE_NAME ": Failed to register modifier tracker: %d\n", error);
+            goto err_unregister_companion;
+        }
+    }
+    
+    /* Register input handler */
+    error = input_register_handler(&m720_handler);
+    if (error) {
+        printk(KERN_ERR MODULE_NAME ": Failed to register input handler: %d\n", error);
+        if (track_modifiers)
+            input_unregister_handler(&m720_tracker_handler);
+        goto err_unregister_companion;
+    }
+    
+    printk(KERN_INFO MODULE_NAME ": Module loaded successfully\n");
+    return 0;
+
+err_unregister_companion:
+    if (companion_inject)
+        input_unregister_handler(&m720_companion_handler);
+    m720_output_destroy_all();
+err_unregister_class:
+#ifndef M720_FIXED_PROFILE
+    debugfs_remove_recursive(m720_debugfs_root);
+#endif
+    class_unregister(&m720_class);
+err_destroy_cache:
+    kmem_cache_destroy(m720_device_cache);
+err_free_keymap:
+    m720_config_free();
+    return error;
+}
+
+/*
+ * Module cleanup
+ */
+static void __exit m720_remapper_exit(void)
+{
+    printk(KERN_INFO MODULE_NAME ": Unloading module\n");
+    
+    /* Unregister input handlers */
     input_unregister_handler(&m720_handler);
+    if (track_modifiers)
+        input_unregister_handler(&m720_tracker_handler);
+    if (companion_inject)
+        input_unregister_handler(&m720_companion_handler);
+    
+    /* Drop any state parked for reconnect */
+    m720_park_flush();
+#ifndef M720_FIXED_PROFILE
+    debugfs_remove_recursive(m720_debugfs_root);
+#endif
+    
+    /* Destroy the per-seat virtual keyboards */
+    m720_output_destroy_all();
+    
+    class_unregister(&m720_class);
+    
+    kmem_cache_destroy(m720_device_cache);
     
-    /* Destroy virtual keyboard */
-    destroy_virtual_keyboard(global_virtual_kbd);
-    global_virtual_kbd = NULL;
+    /* Wait for keymaps retired by parameter writes, then free the last */
+    rcu_barrier();
+    m720_config_free();
     
     printk(KERN_INFO MODULE_NAME ": Module unloaded (handled %d devices)\n", 
            device_count);
@@ -463,8 +4462,8 @@ static void __exit m720_remapper_exit(void)
 /* Module metadata */
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("GitHub Copilot");
-MODULE_DESCRIPTION(MODULE_DESCRIPTION);
-MODULE_VERSION(MODULE_VERSION);
+MODULE_DESCRIPTION(M720_DESCRIPTION);
+MODULE_VERSION(M720_VERSION);
 
 module_init(m720_remapper_init);
 module_exit(m720_remapper_exit);
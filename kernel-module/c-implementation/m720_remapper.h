@@ -6,14 +6,28 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/cache.h>
 #include <linux/uinput.h>
-#include <linux/usb.h>
-#include <linux/hid.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/device.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+
+#include "m720_transform.h"
 
 /* Module information */
 #define MODULE_NAME "m720_remapper"
-#define MODULE_VERSION "1.0.0"
-#define MODULE_DESCRIPTION "Logitech M720 Triathlon Button Remapper"
+#define M720_VERSION "1.0.0"
+#define M720_DESCRIPTION "Logitech M720 Triathlon Button Remapper"
 
 /* Logitech M720 identifiers */
 #define LOGITECH_VENDOR_ID 0x046d
@@ -21,33 +35,549 @@
 #define M720_PRODUCT_ID_2  0xb015  /* Bluetooth */
 #define M720_PRODUCT_ID_3  0xb013  /* Unifying receiver */
 
+/* Default match rules: the M720's ids, then its name on any Logitech bus */
+#define M720_DEFAULT_RULES \
+    "vendor=046d,product=405e,keys=side+extra;" \
+    "vendor=046d,product=b015,keys=side+extra;" \
+    "vendor=046d,product=b013,keys=side+extra;" \
+    "vendor=046d,name=*M720*,keys=side+extra"
+#define M720_MAX_RULES          16
+#define M720_RULE_NAME_LEN      64
+#define M720_RULES_SPEC_LEN     512
+
 /* Button mappings */
 #define M720_SIDE_BUTTON_1 BTN_SIDE
 #define M720_SIDE_BUTTON_2 BTN_EXTRA
 #define M720_FORWARD_BTN   BTN_FORWARD
 #define M720_BACK_BTN      BTN_BACK
 
-/* Key combinations to send */
-#define WORKSPACE_UP_KEY1   KEY_LEFTMETA
-#define WORKSPACE_UP_KEY2   KEY_PAGEUP
-#define WORKSPACE_DOWN_KEY1 KEY_LEFTMETA
-#define WORKSPACE_DOWN_KEY2 KEY_PAGEDOWN
+/* Buttons BTN_LEFT..BTN_TASK are addressed by (code - BTN_MOUSE) */
+#define M720_NUM_BUTTONS   8
 
-/* Module parameters */
-extern int debug_mode;
-extern int remap_side_buttons;
-extern int remap_extra_buttons;
+/* Action sources: the buttons, then the wheel directions */
+#define M720_NUM_SOURCES   (M720_NUM_BUTTONS + M720_WHEEL_DIRS)
 
-/* Main structures */
-struct m720_device {
-    struct input_dev *input_dev;
+/* What a mapping program emits for a button queues as a source of its own */
+#define M720_PROG_SOURCE(button)   (M720_NUM_SOURCES + (button))
+
+/* Default mapping: workspace down/up on the side buttons, Alt+Tab on forward */
+#define M720_DEFAULT_KEYMAP \
+    "side=leftmeta+pagedown;extra=leftmeta+pageup;" \
+    "forward=leftalt+tab;back=leftmeta+pagedown"
+
+/* Device identity and transports */
+#define M720_IDENT_LEN          128
+#define M720_MAX_ALIASES        8
+#define M720_MAX_LINKS          3       /* Unifying, Bluetooth, USB receiver */
+#define M720_TRANSPORT_HOLD_MS  500
+
+/* Output device routing */
+#define M720_SEAT_LEN           48
+#define M720_DEFAULT_SEAT       "input"
+
+/* Macro engine limits */
+#define M720_MACRO_MAX_STEPS    32
+#define M720_MACRO_QUEUE_LEN    4
+#define M720_MACRO_MAX_DELAY_MS 1000
+#define M720_CHORD_MAX_KEYS     6
+#define M720_CHORD_HOLD_MS      10
+#define M720_KEYMAP_SPEC_LEN    256
+#ifdef M720_FIXED_PROFILE
+#define M720_MAX_PROFILES       1  /* the compiled-in profile only */
+#else
+#define M720_MAX_PROFILES       4
+#endif
+
+/* Keyboard modifiers, tracked for chords with track_modifiers */
+#define M720_MOD_KEYS           8       /* left and right ctrl, shift, alt, meta */
+#define M720_MOD_CTRL           BIT(0)
+#define M720_MOD_SHIFT          BIT(1)
+#define M720_MOD_ALT            BIT(2)
+#define M720_MOD_META           BIT(3)
+#define M720_MAX_CHORDS         8
+
+/* Mapping programs */
+#define M720_PROG_MAX_INSNS     64
+#define M720_PROG_REGS          4
+#define M720_PROG_SCRATCH       8       /* per-device slots */
+#define M720_PROG_MAX_REPEAT    16
+#define M720_PROG_MAX_DEPTH     2       /* nested repeat blocks */
+#define M720_PROG_MAX_COST      1024    /* instructions per event, worst case */
+#define M720_PROG_LABEL_LEN     16
+#define M720_PROG_SPEC_LEN      1024
+
+/* Per-device statistics */
+#define M720_LATENCY_BUCKETS    16
+#define M720_RECORD_LEN         128     /* flight recorder, power of two */
+#define M720_INTERVAL_BUCKETS   20      /* log2 us, up to ~0.5 s */
+#define M720_BURST_GAP_US       50000   /* longer intervals end a burst */
+
+/* Kinetic wheel */
+#define M720_KINETIC_TICK_MS    8
+#define M720_KINETIC_GAP_MS     100     /* wheel idle this long ends a flick */
+#define M720_KINETIC_SHIFT      8       /* velocity is Q8 hi-res units/tick */
+#define M720_KINETIC_MAX_SPEED  (8 * M720_WHEEL_DETENT) /* units per tick */
+#define M720_WHEEL_DETENT       120     /* hi-res units per REL_WHEEL step */
+
+/* Kernels before 5.0 lack the hi-res axis, and no device reports it there */
+#ifndef REL_WHEEL_HI_RES
+#define REL_WHEEL_HI_RES        0x0b
+#endif
+
+/*
+ * Parameters read on the event path, snapshotted whole on every write
+ * and published under RCU so a decision never sees half an update.
+ */
+struct m720_config {
+    bool remap_side;
+    bool remap_extra;
+    bool preserve_timestamps;
+    u32 rate_limit;
+    u32 rate_burst;
+    u32 debounce_ms[M720_NUM_BUTTONS];
+    bool kinetic_scroll;
+    u32 scroll_friction;            /* per mille of velocity lost per tick */
+    bool pointer_transform;
+    struct m720_xform xform;
+    u32 gesture_threshold;          /* counts of travel to pick a direction */
+    struct rcu_head rcu;
+};
+
+/*
+ * What the filter did with an event. Verdicts from M720_VERDICT_BOUNCE
+ * on consume the event.
+ */
+enum m720_verdict {
+    M720_VERDICT_PASS,          /* not ours, passed on */
+    M720_VERDICT_DISABLED,      /* device disabled through sysfs */
+    M720_VERDICT_STANDBY,       /* from a standby transport */
+    M720_VERDICT_BOUNCE,        /* debounced */
+    M720_VERDICT_CONSUMED,      /* release or repeat of a mapped button */
+    M720_VERDICT_QUEUED,        /* macro queued */
+    M720_VERDICT_COALESCED,     /* merged into a pending macro */
+    M720_VERDICT_DROPPED,       /* macro queue full or no output */
+    M720_VERDICT_LIMITED,       /* over rate_limit */
+    M720_VERDICT_WITHHELD,      /* mapped button from a standby transport */
+};
+
+/*
+ * Flight recorder entry, also the frames.bin record layout (16 bytes,
+ * native endian)
+ */
+struct m720_record {
+    u64 time;                       /* frame event time, ns, CLOCK_MONOTONIC */
+    s32 value;
+    u16 code;
+    u8 type;
+    u8 verdict;                     /* enum m720_verdict */
+};
+
+/* A flight recorder snapshot held open by a frames.bin reader */
+struct m720_frames {
+    unsigned int count;
+    struct m720_record recs[M720_RECORD_LEN];
+};
+
+/* Fields a match rule checks */
+#define M720_RULE_BUS           BIT(0)
+#define M720_RULE_VENDOR        BIT(1)
+#define M720_RULE_PRODUCT       BIT(2)
+#define M720_RULE_NAME          BIT(3)
+#define M720_RULE_KEYS          BIT(4)
+
+struct m720_rule {
+    u8 fields;                      /* M720_RULE_* */
+    bool exclude;
+    u16 bustype;
+    u16 vendor;
+    u16 product;
+    char name[M720_RULE_NAME_LEN];  /* glob */
+    DECLARE_BITMAP(keybit, KEY_CNT);    /* all required */
+};
+
+/* Compiled match_rules, published under RCU */
+struct m720_rules {
+    unsigned int count;
+    struct m720_rule rule[M720_MAX_RULES];
+    char spec[M720_RULES_SPEC_LEN];
+    struct rcu_head rcu;
+};
+
+/*
+ * Macro step opcodes. A layer key compiles to a single LAYER or TOGGLE
+ * step and is handled by the filter instead of being queued.
+ */
+enum m720_step_op {
+    M720_STEP_PRESS,
+    M720_STEP_RELEASE,
+    M720_STEP_SYNC,
+    M720_STEP_DELAY,
+    M720_STEP_LAYER,                /* layer arg while held */
+    M720_STEP_TOGGLE,               /* layer arg on or off per press */
+};
+
+/* One precompiled macro step; arg is a key code, a delay in ms or a layer */
+struct m720_step {
+    u16 op;
+    u16 arg;
+};
+
+struct m720_macro {
+    u8 len;
+    struct m720_step steps[M720_MACRO_MAX_STEPS];
+};
+
+/* Directions of a gesture, named gesture_left etc. in a keymap */
+enum m720_gesture_dir {
+    M720_GESTURE_LEFT,
+    M720_GESTURE_RIGHT,
+    M720_GESTURE_UP,
+    M720_GESTURE_DOWN,
+    M720_GESTURE_DIRS,
+};
+
+#define M720_GESTURE_NONE       0xff    /* no gesture button held */
+
+/* Settings latched for the report being read, see m720_frame() */
+#define M720_FRAME_OPEN         BIT(0)
+#define M720_FRAME_POINTER      BIT(1)  /* pointer_transform */
+#define M720_FRAME_KINETIC      BIT(2)  /* kinetic_scroll */
+
+/* Wheel directions, named wheel_up etc. in a keymap */
+enum m720_wheel_dir {
+    M720_WHEEL_UP,
+    M720_WHEEL_DOWN,
+    M720_WHEEL_LEFT,
+    M720_WHEEL_RIGHT,
+    M720_WHEEL_DIRS,
+};
+
+/* A button pressed while exactly mods are held on a keyboard */
+struct m720_chord {
+    u8 button;                      /* code - BTN_MOUSE */
+    u8 mods;                        /* M720_MOD_* */
+    struct m720_macro macro;
+};
+
+/* Compiled form of the keymap parameter, replaced as a whole via RCU */
+struct m720_keymap {
+    struct m720_macro action[M720_NUM_BUTTONS];
+    u8 chord_buttons;               /* buttons with chords, bit (code - BTN_MOUSE) */
+    u8 chords;
+    struct m720_chord chord[M720_MAX_CHORDS];
+    u16 gesture_button;             /* BTN_* code, 0 = no gesture button */
+    struct m720_macro gesture[M720_GESTURE_DIRS];
+    struct m720_macro wheel[M720_WHEEL_DIRS];
+    DECLARE_BITMAP(keybit, KEY_CNT);  /* every key the macros press */
+    char spec[M720_KEYMAP_SPEC_LEN];
+    struct rcu_head rcu;
+};
+
+/*
+ * Mapping program opcodes. Operands: dst is a register, src a register
+ * or M720_PROG_IMM for imm, aux a jump target, scratch slot, context
+ * field or the index of a repeat block's end.
+ */
+enum m720_prog_op {
+    M720_OP_MOV,                    /* dst = src */
+    M720_OP_ADD,
+    M720_OP_SUB,
+    M720_OP_AND,
+    M720_OP_OR,
+    M720_OP_XOR,
+    M720_OP_LD,                     /* dst = context field aux */
+    M720_OP_LDM,                    /* dst = scratch slot aux */
+    M720_OP_STM,                    /* scratch slot aux = src */
+    M720_OP_JA,                     /* jump to aux */
+    M720_OP_JEQ,                    /* jump to aux if dst == src */
+    M720_OP_JNE,
+    M720_OP_JGT,                    /* signed */
+    M720_OP_JLT,
+    M720_OP_JSET,                   /* jump to aux if dst & src */
+    M720_OP_REPEAT,                 /* run up to the end at aux imm times */
+    M720_OP_END,
+    M720_OP_PRESS,                  /* key imm */
+    M720_OP_RELEASE,
+    M720_OP_TAP,
+    M720_OP_SYNC,
+    M720_OP_DELAY,                  /* imm ms */
+    M720_OP_RUN,                    /* keymap action of button imm */
+    M720_OP_EXIT,                   /* with enum m720_prog_exit imm */
+};
+
+#define M720_PROG_IMM           0xff
+
+/* How a program leaves the event */
+enum m720_prog_exit {
+    M720_PROG_NEXT,                 /* on to the keymap */
+    M720_PROG_PASS,                 /* passed on unmapped */
+    M720_PROG_DROP,                 /* consumed */
+};
+
+/* Read-only event context a program can load */
+enum m720_prog_ctx {
+    M720_CTX_CODE,                  /* BTN_* code */
+    M720_CTX_VALUE,                 /* 0 release, 1 press, 2 repeat */
+    M720_CTX_BUTTONS,               /* held buttons, bit (code - BTN_MOUSE) */
+    M720_CTX_LAYER,                 /* active layer */
+    M720_CTX_PROFILE,               /* base layer */
+    M720_CTX_MODS,                  /* keyboard modifiers, M720_MOD_* */
+    M720_CTX_FIELDS,
+};
+
+struct m720_insn {
+    u8 op;
+    u8 dst;
+    u8 src;
+    u8 aux;
+    s32 imm;
+};
+
+/*
+ * Compiled and verified form of the program parameter, replaced as a
+ * whole via RCU. cost is the verifier's bound on instructions run per
+ * event; gen tells devices to clear their scratch slots.
+ */
+struct m720_program {
+    u32 len;
+    u32 cost;
+    u32 gen;
+    struct m720_insn insn[M720_PROG_MAX_INSNS];
+    DECLARE_BITMAP(keybit, KEY_CNT);  /* every key the program presses */
+    char spec[M720_PROG_SPEC_LEN];
+    struct rcu_head rcu;
+};
+
+/* Operand kinds of a program mnemonic */
+enum m720_prog_arg {
+    M720_ARG_NONE,
+    M720_ARG_DST,                   /* register */
+    M720_ARG_SRC,                   /* register, number or button name */
+    M720_ARG_LABEL,
+    M720_ARG_CTX,                   /* context field name */
+    M720_ARG_SLOT,                  /* scratch slot */
+    M720_ARG_NUM,                   /* repeat count or delay in ms */
+    M720_ARG_KEY,
+    M720_ARG_BUTTON,
+    M720_ARG_EXIT,                  /* next, pass or drop */
+};
+
+struct m720_mnemonic {
+    const char *name;
+    u8 op;
+    u8 args[3];
+};
+
+/* Program parser scratch, too big for the stack */
+struct m720_prog_parse {
+    char *stmt[M720_PROG_MAX_INSNS];
+    char *label[M720_PROG_MAX_INSNS];
+    u8 label_at[M720_PROG_MAX_INSNS];
+    unsigned int labels;
+};
+
+/*
+ * Virtual keyboard for one seat tag. Input devices cannot be registered
+ * from connect() (input_mutex is held), so registration runs from
+ * register_work and dev is published via RCU once it is live; the same
+ * work swaps in a new device when the keymaps need more keys. Outputs
+ * are created by the first mouse on a seat and torn down output_grace_ms
+ * after the last one leaves.
+ */
+struct m720_output {
+    struct list_head node;
+    unsigned int users;             /* connected mice routed here */
+    unsigned long idle_at;          /* jiffies when users dropped to 0 */
+    struct input_dev __rcu *dev;
+    struct input_handle __rcu *companion;  /* injected into instead of dev */
+    spinlock_t lock;                /* one runner's frame at a time */
+    DECLARE_BITMAP(keybit, KEY_CNT);  /* keys dev advertises */
+    struct work_struct register_work;
+    char seat[M720_SEAT_LEN];
+    char phys[M720_SEAT_LEN + 16];
+};
+
+/*
+ * A keyboard whose modifier keys are tracked for chords. Its handle
+ * has an event callback only, so its traffic is never filtered.
+ */
+struct m720_tracker {
     struct input_handle handle;
-    struct input_dev *virtual_kbd;
-    char name[128];
-    char phys[128];
+    u8 held;                        /* bit per m720_mod_keys[] entry */
+};
+
+/* A real keyboard on a seat, bound only to inject into */
+struct m720_companion {
+    struct list_head node;
+    struct input_handle handle;
+    char seat[M720_SEAT_LEN];
+};
+
+/*
+ * Per-device macro state machine. Queued macros are copied into the
+ * preallocated ring so nothing is allocated or freed while firing.
+ */
+struct m720_macro_runner {
+    struct m720_output *output;
+    spinlock_t lock;
+    u8 head;
+    u8 count;
+    u8 pos;
+    bool waiting;
+    bool dirty;                     /* keys emitted since the last sync */
+    u8 skipped;                     /* m720_mod_keys[] already held, left alone */
+    u32 dropped;
+    u32 coalesced;
+    unsigned long pending;          /* sources queued but not yet started */
+    struct hrtimer timer;
+    ktime_t clock;                  /* event time of the frame being emitted */
+    u8 source[M720_MACRO_QUEUE_LEN];
+    ktime_t queued_at[M720_MACRO_QUEUE_LEN];
+    ktime_t stamp[M720_MACRO_QUEUE_LEN];    /* source frame event time */
+    u32 msc[M720_MACRO_QUEUE_LEN];          /* source MSC_TIMESTAMP, us */
+    u32 latency[M720_LATENCY_BUCKETS];
+    struct m720_macro queue[M720_MACRO_QUEUE_LEN];
+};
+
+/*
+ * Kinetic wheel state. Wheel motion is consumed in the filter and
+ * re-injected into the mouse from the hrtimer, one batch per tick; once
+ * the wheel stops, the timer keeps emitting the decaying velocity.
+ */
+struct m720_kinetic {
+    spinlock_t lock;
+    bool running;                   /* timer armed or about to re-arm */
+    struct input_handle *handle;    /* link the motion came from */
+    ktime_t last;                   /* event time of the last wheel input */
+    s32 pending;                    /* hi-res units not yet re-injected */
+    s32 velocity;                   /* hi-res units per tick, Q8 */
+    s32 residue;                    /* emitted velocity below one unit, Q8 */
+    s32 detents;                    /* hi-res units short of a REL_WHEEL */
+    struct hrtimer timer;
+};
+
+/*
+ * Pointer transform state. Motion is consumed in the filter, transformed
+ * once per report at SYN_REPORT and re-injected from the hrtimer.
+ */
+struct m720_pointer {
+    spinlock_t lock;
+    bool queued;                    /* timer armed for out_x/out_y */
+    s32 raw_x;                      /* counts of the report being read */
+    s32 raw_y;
+    ktime_t last;                   /* event time of the previous report */
+    struct m720_xform_state state;
+    struct input_handle *handle;    /* link the motion came from */
+    s32 out_x;                      /* transformed counts to inject */
+    s32 out_y;
+    struct hrtimer timer;
+};
+
+/* A gesture in progress: travel since the gesture button went down */
+struct m720_gesture {
+    s32 x;
+    s32 y;
+    u8 button;                      /* held gesture button, or M720_GESTURE_NONE */
+};
+
+/* Report timing of one transport of a device */
+struct m720_link_stats {
+    u16 bustype;
+    u32 prev;                       /* previous interval, us */
+    u32 jitter16;                   /* running jitter estimate, us * 16 */
+    u64 frames;
+    ktime_t last;                   /* event time of the last frame */
+    u32 intervals[M720_INTERVAL_BUCKETS];
+};
+
+/* Two identities of the same physical mouse */
+struct m720_alias {
+    char from[M720_IDENT_LEN];
+    char to[M720_IDENT_LEN];
+};
+
+/*
+ * Per-device state, allocated from m720_device_cache.
+ *
+ * The first cache line holds what the filter reads for every event, in
+ * the order it reads it: the re-injection mark, the flags and transport
+ * checked by m720_decide(), the event counter and recorder head (no
+ * recorder in a fixed-profile build), and the state motion events look
+ * at. The second holds the scalars of the
+ * button path. Per-button arrays, the per-link frame stats, the kinetic
+ * and pointer state (touched only with those features on) and the macro
+ * runner follow, the runner's queue ring last. The input handles
+ * (walked by the input core) start on their own line and identification
+ * strings sit at the end. One physical mouse has one state with a
+ * handle per transport.
+ */
+struct m720_device {
+    /* Hot: first cache line, read or written for every event */
+    int injecting_cpu;              /* CPU re-injecting into the mouse, else -1 */
     bool enabled;
+    u8 frame;                       /* M720_FRAME_* */
+    u8 profile;                     /* base layer */
+    bool rate_ok;                   /* rate_edge was within the rate limit */
+    struct input_handle *active;    /* transport currently processed */
+    unsigned long last_frame;       /* jiffies of the last active frame */
+    u64 events;
+#ifndef M720_FIXED_PROFILE
+    atomic_t record_head;           /* flight recorder records written, ever */
+#endif
+    struct m720_gesture gesture;
+    unsigned long buttons;          /* held buttons, bit (code - BTN_MOUSE) */
+    unsigned long layers;           /* layers switched on above the base */
+
+    /* Button and wheel events */
+    unsigned long chorded ____cacheline_aligned_in_smp; /* held buttons that fired a chord */
+    u8 key_layer[M720_NUM_BUTTONS]; /* layer a held button was resolved in */
+    u64 remapped;
+    u32 bounces;
+    u32 limited;
+    u64 rate_edge;                  /* events count of the edge last charged */
+    u32 msc_base;                   /* last MSC_TIMESTAMP from the mouse */
+    u32 prog_gen;                   /* program the scratch slots belong to */
+    ktime_t msc_at;                 /* frame time msc_base arrived with */
+    ktime_t last_edge[M720_NUM_BUTTONS];
+    u64 rate_tat[M720_NUM_SOURCES]; /* token bucket state, see m720_rate_allow() */
+    s32 scratch[M720_PROG_SCRATCH];
+
+    /* Once per frame, or only with a feature on */
+#ifndef M720_FIXED_PROFILE
+    struct m720_link_stats link_stats[M720_MAX_LINKS];
+#endif
+    spinlock_t inject_lock;         /* one re-injecting timer at a time */
+    struct m720_kinetic kinetic;
+    struct m720_pointer pointer;
+    struct m720_macro_runner runner;    /* queue[] last */
+
+    /* Warm: walked by the input core on every event */
+    struct input_handle handles[M720_MAX_LINKS] ____cacheline_aligned_in_smp;
+
+    /* Cold: identification and control, only used outside the event path */
+    unsigned long links;            /* handles[] slots in use */
+    struct device *sysfs_dev;
+    struct list_head node;          /* on m720_devices, or m720_parked */
+    unsigned long parked_at;
+    char name[128] ____cacheline_aligned_in_smp;
+    char phys[128];
+    char ident[M720_IDENT_LEN];     /* uniq, else phys, after aliasing */
+#ifndef M720_FIXED_PROFILE
+    struct dentry *debugfs;
+
+    /*
+     * Flight recorder ring, written for each recorded event but never
+     * read on the event path; only its head lives with the hot fields
+     */
+    struct m720_record records[M720_RECORD_LEN] ____cacheline_aligned_in_smp;
+#endif
 };
 
+#ifdef M720_FIXED_PROFILE
+/* Constant keymap and config generated by gen_profile.py */
+#include "m720_profile.h"
+#endif
+
 /* Function prototypes */
 static int __init m720_remapper_init(void);
 static void __exit m720_remapper_exit(void);
@@ -57,14 +587,102 @@ static void m720_disconnect(struct input_handle *handle);
 static bool m720_filter(struct input_handle *handle, unsigned int type,
                        unsigned int code, int value);
 static bool m720_match(struct input_handler *handler, struct input_dev *dev);
-static void m720_event(struct input_handle *handle, unsigned int type,
-                      unsigned int code, int value);
+static enum m720_verdict m720_decide(struct m720_device *m720_dev,
+                                     struct input_handle *handle,
+                                     unsigned int type, unsigned int code,
+                                     int value);
+#ifndef M720_FIXED_PROFILE
+static void m720_record(struct m720_device *m720_dev, struct input_dev *dev,
+                        unsigned int type, unsigned int code, int value,
+                        enum m720_verdict verdict);
+static void m720_profile_frame(struct m720_link_stats *stats,
+                               struct input_dev *dev);
+static void m720_profile_reset(struct m720_link_stats *stats, u16 bustype);
+static int m720_config_publish(void);
+#endif
+static bool m720_debounce(struct m720_device *m720_dev,
+                          const struct m720_config *cfg, unsigned int button,
+                          int value);
+static bool m720_rate_allow(struct m720_device *m720_dev,
+                            const struct m720_config *cfg, unsigned int button);
 
 /* Virtual keyboard functions */
-static struct input_dev *create_virtual_keyboard(void);
+static struct input_dev *create_virtual_keyboard(const struct m720_output *output,
+                                                 const unsigned long *keybit);
 static void destroy_virtual_keyboard(struct input_dev *virt_kbd);
-static void send_key_combination(struct input_dev *virt_kbd, 
-                                unsigned int key1, unsigned int key2);
+static struct m720_output *m720_output_get(struct input_dev *dev);
+static void m720_output_put(struct m720_output *output);
+static void m720_output_destroy_all(void);
+static void m720_output_kick(struct m720_output *output);
+static void m720_emit(struct m720_output *output, unsigned int type,
+                      unsigned int code, int value);
+static void m720_emit_sync(struct m720_macro_runner *runner);
+static struct m720_companion *m720_companion_pick(const char *seat,
+                                                  const unsigned long *keybit);
+
+/* Macro engine functions */
+#ifndef M720_FIXED_PROFILE
+static struct m720_keymap *m720_compile_keymap(const char *spec);
+#endif
+static const struct m720_macro *m720_lookup_macro(const struct m720_config *cfg,
+                                                  unsigned int layer,
+                                                  unsigned int base,
+                                                  unsigned int code);
+static const struct m720_macro *m720_lookup_wheel(unsigned int layer,
+                                                  unsigned int base,
+                                                  unsigned int dir);
+static unsigned int m720_gesture_button(const struct m720_config *cfg,
+                                        unsigned int layer,
+                                        unsigned int base);
+static const struct m720_macro *m720_lookup_gesture(unsigned int layer,
+                                                    unsigned int base,
+                                                    unsigned int dir);
+static void m720_macro_init(struct m720_macro_runner *runner);
+static enum m720_verdict m720_macro_queue(struct m720_macro_runner *runner,
+                                          const struct m720_macro *macro,
+                                          unsigned int button, ktime_t stamp,
+                                          u32 msc);
+static void m720_macro_resume(struct m720_macro_runner *runner);
+static void m720_macro_cancel(struct m720_macro_runner *runner);
+
+/* Kinetic scrolling functions */
+static void m720_kinetic_init(struct m720_kinetic *kin);
+static enum m720_verdict m720_kinetic_input(struct m720_kinetic *kin,
+                                            struct input_handle *handle,
+                                            unsigned int code, int value);
+static void m720_kinetic_brake(struct m720_kinetic *kin);
+static void m720_kinetic_cancel(struct m720_kinetic *kin,
+                                struct input_handle *handle);
+
+/* Pointer transform functions */
+static void m720_pointer_init(struct m720_pointer *ptr);
+static enum m720_verdict m720_pointer_input(struct m720_pointer *ptr,
+                                            unsigned int code, int value);
+static void m720_pointer_frame(struct m720_pointer *ptr,
+                               const struct m720_config *cfg,
+                               struct input_handle *handle);
+static void m720_pointer_cancel(struct m720_pointer *ptr,
+                                struct input_handle *handle);
+
+/* Reconnect handover functions */
+static void m720_park(struct m720_device *m720_dev);
+static struct m720_device *m720_unpark(const char *ident);
+static void m720_park_flush(void);
+static bool m720_claim_transport(struct m720_device *m720_dev,
+                                 struct input_handle *handle);
+
+/* Sysfs functions */
+static void m720_sysfs_add(struct m720_device *m720_dev, struct input_dev *dev);
+static void m720_sysfs_remove(struct m720_device *m720_dev);
+#ifndef M720_FIXED_PROFILE
+static void m720_debugfs_add(struct m720_device *m720_dev, const char *name);
+static unsigned int m720_records_snapshot(struct m720_device *m720_dev,
+                                          struct m720_record *recs);
+#endif
+
+/* Device matching functions */
+static bool m720_rules_match(struct input_dev *dev);
+static struct m720_rules *m720_compile_rules(const char *spec);
 
 /* Utility functions */
 static bool is_m720_device(struct input_dev *dev);
@@ -0,0 +1,145 @@
+#ifndef M720_TRANSFORM_H
+#define M720_TRANSFORM_H
+
+/*
+ * Pointer transform: DPI scale, acceleration curve and angle snapping
+ * on REL_X/REL_Y, in fixed point with per-device subpixel remainders.
+ *
+ * Pure integer code with no kernel dependencies beyond the s32/u32/
+ * s64/u64 types, abs(), min(), max(), min_t(), U32_MAX and div_u64(),
+ * so the benchmark in benchmarks/ can build it in userspace.
+ */
+
+#define M720_XFORM_SHIFT        16      /* scale and gains are Q16 */
+#define M720_ACCEL_POINTS       16      /* curve points, one per step */
+#define M720_ACCEL_STEP_SHIFT   1       /* points every 2 counts/ms */
+#define M720_SPEED_SHIFT        8       /* speed is Q8 counts/ms */
+#define M720_SNAP_MAX_DEG       30
+#define M720_XFORM_MAX_PCT      1000    /* scale and gains, percent */
+#define M720_XFORM_MIN_US       125     /* 8 kHz reports */
+#define M720_XFORM_MAX_US       20000   /* longer gaps start from rest */
+
+/* Precomputed transform parameters, part of the published config */
+struct m720_xform {
+    u32 scale;                      /* DPI scale, Q16 */
+    u32 gain[M720_ACCEL_POINTS];    /* acceleration curve, Q16 */
+    u32 points;                     /* gain[] entries in use, at least 1 */
+    u32 snap_tan;                   /* tan of the snap angle, Q16, 0=off */
+};
+
+/* Per-device transform state */
+struct m720_xform_state {
+    s64 rem_x;                      /* subpixel remainders, Q16 */
+    s64 rem_y;
+    s32 dir_x;                      /* smoothed direction, Q8 */
+    s32 dir_y;
+};
+
+/* tan(0..30 degrees) in Q16, for angle_snap */
+static const u32 m720_tan_q16[M720_SNAP_MAX_DEG + 1] = {
+    0,     1144,  2289,  3435,  4583,  5734,  6888,  8047,
+    9210,  10380, 11556, 12739, 13930, 15130, 16340, 17560,
+    18792, 20036, 21294, 22566, 23853, 25157, 26478, 27818,
+    29179, 30560, 31964, 33392, 34846, 36327, 37837,
+};
+
+/*
+ * Turn the percent-based parameters into the Q16 tables the event path
+ * uses. An empty curve is flat; percentages are capped at 1000.
+ */
+static inline void m720_xform_setup(struct m720_xform *xf, u32 scale_pct,
+                                    const u32 *curve_pct, u32 points,
+                                    u32 snap_deg)
+{
+    u32 i;
+
+    xf->scale = (min(scale_pct, (u32)M720_XFORM_MAX_PCT) <<
+                 M720_XFORM_SHIFT) / 100;
+    xf->points = max(min(points, (u32)M720_ACCEL_POINTS), 1u);
+    for (i = 0; i < xf->points; i++)
+        xf->gain[i] = points ? (min(curve_pct[i], (u32)M720_XFORM_MAX_PCT) <<
+                                M720_XFORM_SHIFT) / 100 :
+                               1u << M720_XFORM_SHIFT;
+    for (; i < M720_ACCEL_POINTS; i++)
+        xf->gain[i] = xf->gain[xf->points - 1];
+    xf->snap_tan = m720_tan_q16[min(snap_deg, (u32)M720_SNAP_MAX_DEG)];
+}
+
+/*
+ * Gain for a speed, interpolated linearly between curve points
+ */
+static inline u32 m720_xform_gain(const struct m720_xform *xf, u32 speed)
+{
+    u32 shift = M720_SPEED_SHIFT + M720_ACCEL_STEP_SHIFT;
+    u32 idx = speed >> shift;
+    u32 frac = speed & ((1u << shift) - 1);
+    s64 g0, g1;
+
+    if (idx + 1 >= xf->points)
+        return xf->gain[xf->points - 1];
+
+    g0 = xf->gain[idx];
+    g1 = xf->gain[idx + 1];
+    return g0 + (((g1 - g0) * frac) >> shift);
+}
+
+/*
+ * Zero the minor axis of motion that stays within the snap angle of
+ * the major one. The direction is smoothed over a few reports, since
+ * single reports of one or two counts have no usable angle.
+ */
+static inline void m720_xform_snap(const struct m720_xform *xf,
+                                   struct m720_xform_state *st,
+                                   s32 *dx, s32 *dy)
+{
+    s64 ax, ay;
+
+    st->dir_x += (*dx * (1 << M720_SPEED_SHIFT) - st->dir_x) / 4;
+    st->dir_y += (*dy * (1 << M720_SPEED_SHIFT) - st->dir_y) / 4;
+
+    ax = abs(st->dir_x);
+    ay = abs(st->dir_y);
+    if (ay << M720_XFORM_SHIFT <= ax * xf->snap_tan) {
+        *dy = 0;
+        st->rem_y = 0;
+    } else if (ax << M720_XFORM_SHIFT <= ay * xf->snap_tan) {
+        *dx = 0;
+        st->rem_x = 0;
+    }
+}
+
+/*
+ * Transform one report's motion in place. interval_us is the time since
+ * the previous report and sets the speed the curve is indexed with.
+ */
+static inline void m720_xform_apply(const struct m720_xform *xf,
+                                    struct m720_xform_state *st,
+                                    s32 *dx, s32 *dy, u32 interval_us)
+{
+    u32 ax = abs(*dx), ay = abs(*dy);
+    u32 mag, speed;
+    u64 factor;
+    s64 x, y;
+
+    if (xf->snap_tan)
+        m720_xform_snap(xf, st, dx, dy);
+
+    /* Octagonal approximation of the length, within 7% */
+    mag = max(ax, ay) + (min(ax, ay) * 3 >> 3);
+    interval_us = min(max(interval_us, (u32)M720_XFORM_MIN_US),
+                      (u32)M720_XFORM_MAX_US);
+    speed = min_t(u64, div_u64((u64)mag * 1000 << M720_SPEED_SHIFT,
+                               interval_us), U32_MAX);
+
+    factor = (u64)xf->scale * m720_xform_gain(xf, speed) >>
+             M720_XFORM_SHIFT;
+
+    x = (s64)*dx * (s64)factor + st->rem_x;
+    y = (s64)*dy * (s64)factor + st->rem_y;
+    *dx = x >> M720_XFORM_SHIFT;
+    *dy = y >> M720_XFORM_SHIFT;
+    st->rem_x = x - (s64)*dx * (1 << M720_XFORM_SHIFT);
+    st->rem_y = y - (s64)*dy * (1 << M720_XFORM_SHIFT);
+}
+
+#endif /* M720_TRANSFORM_H */